@@ -23,7 +23,7 @@ LOCAL_DESTDIR := ./
 LOCAL_MODULE := init
 
 LOCAL_CFLAGS := -g -Wno-format-nonliteral -Wno-format-contains-nul -D_FILE_OFFSET_BITS=64
-LOCAL_LDFLAGS := -Wl,--no-as-needed -ldl -Wl,--as-needed -static-libgcc
+LOCAL_LDFLAGS := -Wl,--no-as-needed -ldl -lpthread -Wl,--as-needed -static-libgcc
 
 PV_BUILD_DIR := $(call local-get-build-dir)
 PV_VERSION_C := $(PV_BUILD_DIR)/version.c
@@ -57,6 +57,8 @@ LOCAL_SRC_FILES := init.c \
 			parser/parser_multi1.c \
 			parser/parser_system1.c \
 			objects.c \
+			chunks.c \
+			mirrors.c \
 			utils/fs.c \
 			utils/system.c \
 			utils/str.c \
@@ -66,6 +68,8 @@ LOCAL_SRC_FILES := init.c \
 			utils/base64.c \
 			utils/math.c \
 			utils/timer.c \
+			utils/ratelimit.c \
+			utils/dlstate.c \
 			jsons.c \
 			pantahub.c \
 			updater.c \
@@ -0,0 +1,581 @@
+/*
+ * Copyright (c) 2017 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
+
+#include <linux/limits.h>
+
+#include <mbedtls/sha256.h>
+
+#include "chunks.h"
+#include "objects.h"
+#include "config.h"
+#include "storage.h"
+#include "utils/fs.h"
+#include "utils/fops.h"
+#include "utils/json.h"
+
+#define MODULE_NAME			"chunks"
+#define pv_log(level, msg, ...)		vlog(MODULE_NAME, level, msg, ## __VA_ARGS__)
+#include "log.h"
+
+/*
+ * Chunks are not stored as copies. Each indexed pool object gets an index
+ * file under chunks/ with a line per chunk: its sha, offset and size in
+ * the object. Indexes are read into a sorted table the first time chunks
+ * are looked up, which is kept until pv_chunks_drop_refs
+ */
+
+struct pv_chunk_ref {
+	char sha256[65];
+	char id[65];
+	off_t offset;
+	off_t size;
+};
+
+static struct pv_chunk_ref *refs_cache = NULL;
+static int refs_cache_n = 0;
+static bool refs_cache_loaded = false;
+static pthread_mutex_t refs_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t gear[256];
+static bool gear_loaded = false;
+
+static void pv_chunks_load_gear(void)
+{
+	uint64_t x = 0, z;
+
+	if (gear_loaded)
+		return;
+
+	// splitmix64, so the table is the same everywhere without shipping it
+	for (int i = 0; i < 256; i++) {
+		x += 0x9e3779b97f4a7c15ULL;
+		z = x;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+
+	gear_loaded = true;
+}
+
+static void pv_chunks_sha_to_str(unsigned char *sha, char *str)
+{
+	for (int i = 0; i < 32; i++)
+		sprintf(str + (i * 2), "%02x", sha[i]);
+	str[64] = '\0';
+}
+
+void pv_chunks_free(struct dl_list *chunks)
+{
+	struct pv_chunk *c, *tmp;
+
+	dl_list_for_each_safe(c, tmp, chunks, struct pv_chunk, list) {
+		dl_list_del(&c->list);
+		free(c);
+	}
+}
+
+static bool pv_chunks_is_size(const char *size)
+{
+	int i;
+
+	for (i = 0; size[i]; i++) {
+		if (!isdigit(size[i]))
+			return false;
+	}
+
+	return (i > 0) && (i < 16);
+}
+
+/*
+ * Parses the chunk manifest of an object of obj_size bytes. Chunks must be
+ * of a size we could have cut and cover the whole object
+ */
+int pv_chunks_parse(const char *json, off_t obj_size, struct dl_list *chunks)
+{
+	int ret = -1, tokc, n;
+	char *sha = NULL, *size = NULL;
+	off_t offset = 0;
+	jsmntok_t *tokv = NULL;
+	jsmntok_t **arr = NULL, **arr_i;
+	struct pv_chunk *c;
+
+	if (!json || (jsmnutil_parse_json(json, &tokv, &tokc) < 0))
+		goto out;
+
+	if (tokv->type != JSMN_ARRAY)
+		goto out;
+
+	n = tokv->size;
+	arr = jsmnutil_get_array_toks(json, tokv);
+	if (!arr)
+		goto out;
+
+	for (arr_i = arr; n > 0; arr_i++, n--) {
+		sha = pv_json_get_value(json, "sha256", *arr_i, tokc - (*arr_i - tokv));
+		size = pv_json_get_value(json, "size", *arr_i, tokc - (*arr_i - tokv));
+		if (!sha || !size || (strlen(sha) != 64) || !pv_chunks_is_size(size))
+			goto out;
+
+		c = calloc(1, sizeof(struct pv_chunk));
+		if (!c)
+			goto out;
+
+		strcpy(c->sha256, sha);
+		c->offset = offset;
+		c->size = atoll(size);
+		if ((c->size <= 0) || (c->size > CHUNK_MAX_SIZE) ||
+			(c->size > obj_size - offset)) {
+			free(c);
+			goto out;
+		}
+		dl_list_init(&c->list);
+		dl_list_add_tail(chunks, &c->list);
+
+		offset += c->size;
+		free(sha);
+		sha = NULL;
+		free(size);
+		size = NULL;
+	}
+
+	if (offset != obj_size)
+		goto out;
+
+	ret = 0;
+
+out:
+	if (ret) {
+		pv_log(WARN, "chunk manifest could not be parsed");
+		pv_chunks_free(chunks);
+	}
+	if (sha)
+		free(sha);
+	if (size)
+		free(size);
+	if (arr)
+		jsmnutil_tokv_free(arr);
+	if (tokv)
+		free(tokv);
+
+	return ret;
+}
+
+static int pv_chunks_ref_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct pv_chunk_ref*) a)->sha256,
+		((const struct pv_chunk_ref*) b)->sha256);
+}
+
+static bool pv_chunks_is_index(const char *name)
+{
+	int i;
+
+	for (i = 0; name[i]; i++) {
+		if (!isxdigit(name[i]))
+			return false;
+	}
+
+	return (i == 64);
+}
+
+/*
+ * Loads the chunks of every indexed object into refs, sorted by sha.
+ * Returns the number of refs
+ */
+static int pv_chunks_load_refs(struct pv_chunk_ref **refs)
+{
+	DIR *d;
+	FILE *fp;
+	struct dirent *dir;
+	struct pv_chunk_ref *r, *tmp;
+	char path[PATH_MAX];
+	intmax_t o, s;
+	int n = 0, size = 0;
+
+	*refs = NULL;
+
+	snprintf(path, sizeof(path), CHUNKS_DIR_FMT, pv_config_get_storage_mntpoint());
+	d = opendir(path);
+	if (!d)
+		return 0;
+
+	while ((dir = readdir(d)) != NULL) {
+		if (!pv_chunks_is_index(dir->d_name))
+			continue;
+
+		snprintf(path, sizeof(path), CHUNKS_INDEX_FMT,
+			pv_config_get_storage_mntpoint(), dir->d_name);
+		fp = fopen(path, "r");
+		if (!fp)
+			continue;
+
+		while (1) {
+			if (n == size) {
+				size = size ? size * 2 : 1024;
+				tmp = realloc(*refs, size * sizeof(struct pv_chunk_ref));
+				if (!tmp)
+					break;
+				*refs = tmp;
+			}
+
+			r = *refs + n;
+			if (fscanf(fp, "%64s %jd %jd", r->sha256, &o, &s) != 3)
+				break;
+			strcpy(r->id, dir->d_name);
+			r->offset = o;
+			r->size = s;
+			n++;
+		}
+		fclose(fp);
+	}
+	closedir(d);
+
+	if (n)
+		qsort(*refs, n, sizeof(struct pv_chunk_ref), pv_chunks_ref_cmp);
+
+	return n;
+}
+
+/*
+ * Reads the chunk from the object the ref points to and checks its hash
+ */
+static int pv_chunks_read(struct pv_chunk *c, struct pv_chunk_ref *r, unsigned char *buf)
+{
+	int fd = -1, ret = -1;
+	char sha[65];
+	char *path = NULL;
+	unsigned char local_sha[32];
+	mbedtls_sha256_context sha256_ctx;
+
+	if (r->size != c->size)
+		return -1;
+
+	path = pv_objects_get_path(r->id);
+	if (!path)
+		goto out;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		goto out;
+
+	if (pread(fd, buf, r->size, r->offset) != r->size)
+		goto out;
+
+	mbedtls_sha256_init(&sha256_ctx);
+	mbedtls_sha256_starts(&sha256_ctx, 0);
+	mbedtls_sha256_update(&sha256_ctx, buf, r->size);
+	mbedtls_sha256_finish(&sha256_ctx, local_sha);
+	mbedtls_sha256_free(&sha256_ctx);
+
+	pv_chunks_sha_to_str(local_sha, sha);
+	if (strcmp(sha, c->sha256))
+		goto out;
+
+	ret = 0;
+
+out:
+	if (ret)
+		pv_log(DEBUG, "chunk %s could not be read from object %s", c->sha256, r->id);
+	if (fd >= 0)
+		close(fd);
+	if (path)
+		free(path);
+
+	return ret;
+}
+
+/*
+ * Writes the chunks already present in the pool into fd at their offsets
+ * and marks them as local. Returns the number of bytes reused
+ */
+off_t pv_chunks_assemble(struct dl_list *chunks, int fd)
+{
+	off_t reused = 0;
+	unsigned char *buf;
+	struct pv_chunk *c, *tmp;
+	struct pv_chunk_ref key, *refs, *r;
+	int n;
+
+	// the table is only read until it is dropped, after the downloads
+	pthread_mutex_lock(&refs_cache_lock);
+	if (!refs_cache_loaded) {
+		refs_cache_n = pv_chunks_load_refs(&refs_cache);
+		refs_cache_loaded = true;
+	}
+	refs = refs_cache;
+	n = refs_cache_n;
+	pthread_mutex_unlock(&refs_cache_lock);
+
+	if (!n)
+		return 0;
+
+	buf = malloc(CHUNK_MAX_SIZE);
+	if (!buf)
+		return 0;
+
+	dl_list_for_each_safe(c, tmp, chunks, struct pv_chunk, list) {
+		if ((c->size <= 0) || (c->size > CHUNK_MAX_SIZE))
+			continue;
+
+		strcpy(key.sha256, c->sha256);
+		r = bsearch(&key, refs, n, sizeof(struct pv_chunk_ref), pv_chunks_ref_cmp);
+		if (!r)
+			continue;
+
+		// the same chunk can be in several objects, any of them will do
+		while ((r > refs) && !strcmp((r - 1)->sha256, c->sha256))
+			r--;
+		for (; (r < refs + n) && !strcmp(r->sha256, c->sha256); r++) {
+			if (!pv_chunks_read(c, r, buf))
+				break;
+		}
+		if ((r == refs + n) || strcmp(r->sha256, c->sha256))
+			continue;
+
+		if (pwrite(fd, buf, c->size, c->offset) != c->size) {
+			pv_log(WARN, "could not write chunk %s: %s", c->sha256, strerror(errno));
+			continue;
+		}
+
+		c->local = true;
+		reused += c->size;
+	}
+
+	free(buf);
+
+	return reused;
+}
+
+/*
+ * Frees the table of indexed chunks, so the next lookup reads the indexes
+ * again. Must not be called while chunks are being assembled
+ */
+void pv_chunks_drop_refs(void)
+{
+	pthread_mutex_lock(&refs_cache_lock);
+	if (refs_cache)
+		free(refs_cache);
+	refs_cache = NULL;
+	refs_cache_n = 0;
+	refs_cache_loaded = false;
+	pthread_mutex_unlock(&refs_cache_lock);
+}
+
+static int pv_chunks_add_ref(const char *sha, off_t offset, off_t size, int index_fd)
+{
+	int len;
+	char buf[128];
+
+	len = snprintf(buf, sizeof(buf), "%s %"PRIu64" %"PRIu64"\n",
+		sha, (uint64_t) offset, (uint64_t) size);
+	if (pv_fops_write_nointr(index_fd, buf, len) != len)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Cuts the object in content defined chunks using a gear rolling hash and
+ * writes its index. Objects already indexed are skipped
+ */
+int pv_chunks_index_object(const char *id)
+{
+	int fd = -1, index_fd = -1, ret = -1;
+	ssize_t bytes, i, start;
+	char *path = NULL;
+	char index[PATH_MAX], index_tmp[PATH_MAX];
+	char sha[65];
+	unsigned char buf[4096];
+	unsigned char local_sha[32];
+	uint64_t hash = 0;
+	off_t offset = 0, size = 0;
+	struct stat st;
+	mbedtls_sha256_context sha256_ctx;
+
+	snprintf(index, sizeof(index), CHUNKS_INDEX_FMT,
+		pv_config_get_storage_mntpoint(), id);
+	if (!stat(index, &st))
+		return 0;
+
+	pv_chunks_load_gear();
+
+	path = pv_objects_get_path(id);
+	if (!path)
+		return -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pv_log(WARN, "could not open %s: %s", path, strerror(errno));
+		goto out;
+	}
+
+	snprintf(index_tmp, sizeof(index_tmp), CHUNKS_DIR_FMT,
+		pv_config_get_storage_mntpoint());
+	mkdir_p(index_tmp, 0755);
+
+	snprintf(index_tmp, sizeof(index_tmp), "%s.tmp", index);
+	index_fd = open(index_tmp, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (index_fd < 0) {
+		pv_log(WARN, "could not open %s: %s", index_tmp, strerror(errno));
+		goto out;
+	}
+
+	pv_log(DEBUG, "indexing chunks of object %s", id);
+
+	mbedtls_sha256_init(&sha256_ctx);
+	mbedtls_sha256_starts(&sha256_ctx, 0);
+
+	while ((bytes = read(fd, buf, sizeof(buf))) > 0) {
+		start = 0;
+		for (i = 0; i < bytes; i++) {
+			hash = (hash << 1) + gear[buf[i]];
+			size++;
+
+			if ((size < CHUNK_MIN_SIZE || (hash & CHUNK_MASK)) &&
+				(size < CHUNK_MAX_SIZE))
+				continue;
+
+			mbedtls_sha256_update(&sha256_ctx, buf + start, i + 1 - start);
+			mbedtls_sha256_finish(&sha256_ctx, local_sha);
+			pv_chunks_sha_to_str(local_sha, sha);
+			if (pv_chunks_add_ref(sha, offset, size, index_fd))
+				goto finish;
+
+			start = i + 1;
+			offset += size;
+			size = 0;
+			hash = 0;
+			mbedtls_sha256_starts(&sha256_ctx, 0);
+		}
+		mbedtls_sha256_update(&sha256_ctx, buf + start, bytes - start);
+	}
+
+	if (bytes < 0)
+		goto finish;
+
+	if (size) {
+		mbedtls_sha256_finish(&sha256_ctx, local_sha);
+		pv_chunks_sha_to_str(local_sha, sha);
+		if (pv_chunks_add_ref(sha, offset, size, index_fd))
+			goto finish;
+	}
+
+	fsync(index_fd);
+	close(index_fd);
+	index_fd = -1;
+	rename(index_tmp, index);
+	syncdir(index);
+
+	ret = 0;
+
+finish:
+	mbedtls_sha256_free(&sha256_ctx);
+out:
+	if (ret)
+		pv_log(WARN, "could not index chunks of object %s", id);
+	if (index_fd >= 0) {
+		close(index_fd);
+		remove(index_tmp);
+	}
+	if (fd >= 0)
+		close(fd);
+	if (path)
+		free(path);
+
+	return ret;
+}
+
+/*
+ * Drops the index of an object that is about to be removed from the pool
+ */
+void pv_chunks_remove_object(const char *id)
+{
+	char index[PATH_MAX];
+
+	snprintf(index, sizeof(index), CHUNKS_INDEX_FMT,
+		pv_config_get_storage_mntpoint(), id);
+
+	if (remove(index))
+		return;
+	syncdir(index);
+
+	pv_log(DEBUG, "removed chunk index of object %s", id);
+}
+
+/*
+ * Appends to paths a struct pv_path per index that was not finished
+ */
+int pv_chunks_get_leftovers(struct dl_list *paths)
+{
+	DIR *d;
+	struct dirent *dir;
+	struct pv_path *p;
+	char path[PATH_MAX];
+	size_t len;
+	int ret = 0;
+
+	snprintf(path, sizeof(path), CHUNKS_DIR_FMT, pv_config_get_storage_mntpoint());
+	d = opendir(path);
+	if (!d)
+		return 0;
+
+	while ((dir = readdir(d)) != NULL) {
+		len = strlen(dir->d_name);
+		if ((len <= 4) || strcmp(dir->d_name + len - 4, ".tmp"))
+			continue;
+
+		p = calloc(1, sizeof(struct pv_path));
+		if (!p) {
+			ret = -1;
+			break;
+		}
+
+		snprintf(path, sizeof(path), CHUNKS_INDEX_FMT,
+			pv_config_get_storage_mntpoint(), dir->d_name);
+		p->path = strdup(path);
+		if (!p->path) {
+			free(p);
+			ret = -1;
+			break;
+		}
+
+		dl_list_init(&p->list);
+		dl_list_add_tail(paths, &p->list);
+	}
+	closedir(d);
+
+	return ret;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2017 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef PV_CHUNKS_H
+#define PV_CHUNKS_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "utils/list.h"
+
+#define CHUNKS_DIR_FMT	"%s/chunks"
+#define CHUNKS_INDEX_FMT	"%s/chunks/%s"
+
+// content defined chunking parameters. Chunk manifests coming from the
+// server must have been cut with the same ones to be reused
+#define CHUNK_MIN_SIZE	(16 * 1024)
+#define CHUNK_MAX_SIZE	(256 * 1024)
+#define CHUNK_MASK	0xffff000000000000ULL
+
+struct pv_chunk {
+	char sha256[65];
+	off_t offset;
+	off_t size;
+	bool local;
+	struct dl_list list;
+};
+
+int pv_chunks_parse(const char *json, off_t obj_size, struct dl_list *chunks);
+void pv_chunks_free(struct dl_list *chunks);
+
+off_t pv_chunks_assemble(struct dl_list *chunks, int fd);
+void pv_chunks_drop_refs(void);
+
+int pv_chunks_index_object(const char *id);
+void pv_chunks_remove_object(const char *id);
+int pv_chunks_get_leftovers(struct dl_list *paths);
+
+#endif // PV_CHUNKS_H
@@ -132,10 +132,14 @@ static void config_override_value_string(struct dl_list *config_list, char *key,
 {
 	char *item = config_get_value(config_list, key);
 
+	// keys missing in the override file keep their base value
+	if (!item)
+		return;
+
 	if (*out)
 		free(*out);
 
-	if (item && strlen(item) > 0)
+	if (strlen(item) > 0)
 		*out = strdup(item);
 	else
 		*out = NULL;
@@ -189,6 +193,7 @@ static int pv_config_load_config_from_file(char *path, struct pantavisor_config
 	config->storage.mnttype = config_get_value_string(&config_list, "storage.mnttype", NULL);
 	config->storage.logtempsize = config_get_value_string(&config_list, "storage.logtempsize", NULL);
 	config->storage.wait = config_get_value_int(&config_list, "storage.wait", 5);
+	config->storage.chunks = config_get_value_bool(&config_list, "storage.chunks", false);
 
 	config->storage.gc.reserved = config_get_value_int(&config_list, "storage.gc.reserved", 5);
 	config->storage.gc.keep_factory = config_get_value_bool(&config_list, "storage.gc.keep_factory", false);
@@ -200,6 +205,15 @@ static int pv_config_load_config_from_file(char *path, struct pantavisor_config
 	config->net.brmask4 = config_get_value_string(&config_list, "net.brmask4", "255.255.255.0");
 
 	config->updater.use_tmp_objects = config_get_value_bool(&config_list, "updater.use_tmp_objects", false);
+	config->updater.delta = config_get_value_bool(&config_list, "updater.delta", false);
+	config->updater.download_workers = config_get_value_int(&config_list, "updater.download.workers", 1);
+	config->updater.download_writeback = config_get_value_int(&config_list, "updater.download.writeback", 8192);
+	config->updater.download_ratelimit = config_get_value_int(&config_list, "updater.download.ratelimit", 0);
+	config->updater.download_ratelimit_window = config_get_value_string(&config_list, "updater.download.ratelimit.window", NULL);
+	config->updater.mirrors = config_get_value_string(&config_list, "updater.mirrors", NULL);
+	config->updater.download_compression = config_get_value_bool(&config_list, "updater.download.compression", false);
+	config->updater.coalesce = config_get_value_bool(&config_list, "updater.coalesce", false);
+	config->updater.combined_query = config_get_value_bool(&config_list, "updater.combined_query", false);
 
 	config->updater.revision_retries = config_get_value_int(&config_list, "revision.retries", 10);
 	config->updater.revision_retry_timeout = config_get_value_int(&config_list, "revision.retries.timeout", 2 * 60);
@@ -247,11 +261,15 @@ static int pv_config_load_creds_from_file(char *path, struct pantavisor_config *
 	config->updater.network_timeout = config_get_value_int(&config_list, "updater.network_timeout", 2 * 60);
 	config->updater.commit_delay = config_get_value_int(&config_list, "updater.commit.delay", 3 * 60);
 
+	config->metadata.devmeta_interval = config_get_value_int(&config_list, "metadata.devmeta.interval", 10);
+
 	config->log.logdir = config_get_value_string(&config_list, "log.dir", "/storage/logs/");
 	config->log.logmax = config_get_value_int(&config_list, "log.maxsize", (1 << 21)); // 2 MiB
 	config->log.loglevel = config_get_value_int(&config_list, "log.level", 0);
 	config->log.logsize = config_get_value_logsize(&config_list, "log.buf_nitems", 128) * 1024;
 	config->log.push = config_get_value_bool(&config_list, "log.push", true);
+	config->log.push_ratelimit = config_get_value_int(&config_list, "log.push.ratelimit", 0);
+	config->log.push_ratelimit_window = config_get_value_string(&config_list, "log.push.ratelimit.window", NULL);
 	config->log.capture = config_get_value_bool(&config_list, "log.capture", true);
 	config->log.loggers = config_get_value_bool(&config_list, "log.loggers", true);
 
@@ -278,6 +296,15 @@ static int pv_config_override_config_from_file(char *path, struct pantavisor_con
 	config_override_value_int(&config_list, "storage.gc.threshold.defertime", &config->storage.gc.threshold_defertime);
 
 	config_override_value_bool(&config_list, "updater.use_tmp_objects", &config->updater.use_tmp_objects);
+	config_override_value_bool(&config_list, "updater.delta", &config->updater.delta);
+	config_override_value_int(&config_list, "updater.download.workers", &config->updater.download_workers);
+	config_override_value_int(&config_list, "updater.download.writeback", &config->updater.download_writeback);
+	config_override_value_int(&config_list, "updater.download.ratelimit", &config->updater.download_ratelimit);
+	config_override_value_string(&config_list, "updater.download.ratelimit.window", &config->updater.download_ratelimit_window);
+	config_override_value_string(&config_list, "updater.mirrors", &config->updater.mirrors);
+	config_override_value_bool(&config_list, "updater.download.compression", &config->updater.download_compression);
+	config_override_value_bool(&config_list, "updater.coalesce", &config->updater.coalesce);
+	config_override_value_bool(&config_list, "updater.combined_query", &config->updater.combined_query);
 	config_override_value_int(&config_list, "revision.retries", &config->updater.revision_retries);
 	config_override_value_int(&config_list, "revision.retries.timeout", &config->updater.revision_retry_timeout);
 	config_override_value_bool(&config_list, "updater.keep_factory", &config->storage.gc.keep_factory);
@@ -285,10 +312,14 @@ static int pv_config_override_config_from_file(char *path, struct pantavisor_con
 	config_override_value_int(&config_list, "updater.network_timeout", &config->updater.network_timeout);
 	config_override_value_int(&config_list, "updater.commit.delay", &config->updater.commit_delay);
 
+	config_override_value_int(&config_list, "metadata.devmeta.interval", &config->metadata.devmeta_interval);
+
 	config_override_value_int(&config_list, "log.maxsize", &config->log.logmax);
 	config_override_value_int(&config_list, "log.level", &config->log.loglevel);
 	config_override_value_logsize(&config_list, "log.buf_nitems", &config->log.logsize);
 	config_override_value_bool(&config_list, "log.push", &config->log.push);
+	config_override_value_int(&config_list, "log.push.ratelimit", &config->log.push_ratelimit);
+	config_override_value_string(&config_list, "log.push.ratelimit.window", &config->log.push_ratelimit_window);
 	config_override_value_bool(&config_list, "log.capture", &config->log.capture);
 	config_override_value_bool(&config_list, "log.loggers", &config->log.loggers);
 
@@ -360,6 +391,8 @@ static int pv_config_save_creds_to_file(struct pantavisor_config *config, char *
 	write_config_tuple_int(fd, "updater.commit.delay", config->updater.commit_delay);
 	write_config_tuple_int(fd, "updater.keep_factory", config->storage.gc.keep_factory); // deprecated
 
+	write_config_tuple_int(fd, "metadata.devmeta.interval", config->metadata.devmeta_interval);
+
 	write_config_tuple_int(fd, "log.level", config->log.loglevel);
 	write_config_tuple_int(fd, "log.buf_nitems", config->log.logsize / 1024);
 
@@ -418,6 +451,12 @@ void pv_config_override_value(const char* key, const char* value)
 		pv->config.storage.gc.threshold_defertime = atoi(value);
 	else if (!strcmp(key, "updater.interval"))
 		pv->config.updater.interval = atoi(value);
+	else if (!strcmp(key, "metadata.devmeta.interval"))
+		pv->config.metadata.devmeta_interval = atoi(value);
+	else if (!strcmp(key, "updater.download.ratelimit"))
+		pv->config.updater.download_ratelimit = atoi(value);
+	else if (!strcmp(key, "log.push.ratelimit"))
+		pv->config.log.push_ratelimit = atoi(value);
 	else if (!strcmp(key, "log.level"))
 		pv->config.log.loglevel = atoi(value);
 	else if (!strcmp(key, "pantahub.log.push") || !strcmp(key, "log.push"))
@@ -483,6 +522,13 @@ void pv_config_free()
 
 	if (pv->config.factory.autotok)
 		free(pv->config.factory.autotok);
+
+	if (pv->config.updater.download_ratelimit_window)
+		free(pv->config.updater.download_ratelimit_window);
+	if (pv->config.updater.mirrors)
+		free(pv->config.updater.mirrors);
+	if (pv->config.log.push_ratelimit_window)
+		free(pv->config.log.push_ratelimit_window);
 }
 
 inline void pv_config_set_creds_id(char *id) { pv_get_instance()->config.creds.id = id; }
@@ -512,6 +558,7 @@ char* pv_config_get_storage_mntpoint() { return pv_get_instance()->config.storag
 char* pv_config_get_storage_mnttype() { return pv_get_instance()->config.storage.mnttype; }
 char* pv_config_get_storage_logtempsize() { return pv_get_instance()->config.storage.logtempsize; }
 int pv_config_get_storage_wait() { return pv_get_instance()->config.storage.wait; }
+bool pv_config_get_storage_chunks() { return pv_get_instance()->config.storage.chunks; }
 
 int pv_config_get_storage_gc_reserved() { return pv_get_instance()->config.storage.gc.reserved; }
 bool pv_config_get_storage_gc_keep_factory() { return pv_get_instance()->config.storage.gc.keep_factory; }
@@ -524,6 +571,17 @@ bool pv_config_get_updater_network_use_tmp_objects() { return pv_get_instance()-
 int pv_config_get_updater_revision_retries() { return pv_get_instance()->config.updater.revision_retries; }
 int pv_config_get_updater_revision_retry_timeout() { return pv_get_instance()->config.updater.revision_retry_timeout; }
 int pv_config_get_updater_commit_delay() { return pv_get_instance()->config.updater.commit_delay; }
+bool pv_config_get_updater_delta() { return pv_get_instance()->config.updater.delta; }
+int pv_config_get_updater_download_workers() { return pv_get_instance()->config.updater.download_workers; }
+int pv_config_get_updater_download_writeback() { return pv_get_instance()->config.updater.download_writeback; }
+int pv_config_get_updater_download_ratelimit() { return pv_get_instance()->config.updater.download_ratelimit; }
+char* pv_config_get_updater_download_ratelimit_window() { return pv_get_instance()->config.updater.download_ratelimit_window; }
+char* pv_config_get_updater_mirrors() { return pv_get_instance()->config.updater.mirrors; }
+bool pv_config_get_updater_download_compression() { return pv_get_instance()->config.updater.download_compression; }
+bool pv_config_get_updater_coalesce() { return pv_get_instance()->config.updater.coalesce; }
+bool pv_config_get_updater_combined_query() { return pv_get_instance()->config.updater.combined_query; }
+
+int pv_config_get_metadata_devmeta_interval() { return pv_get_instance()->config.metadata.devmeta_interval; }
 
 int pv_config_get_bl_type() { return pv_get_instance()->config.bl.type; }
 bool pv_config_get_bl_mtd_only() { return pv_get_instance()->config.bl.mtd_only; }
@@ -541,6 +599,8 @@ int pv_config_get_log_logmax() { return pv_get_instance()->config.log.logmax; }
 int pv_config_get_log_loglevel() { return pv_get_instance()->config.log.loglevel; }
 int pv_config_get_log_logsize() { return pv_get_instance()->config.log.logsize; }
 bool pv_config_get_log_push() { return pv_get_instance()->config.log.push; }
+int pv_config_get_log_push_ratelimit() { return pv_get_instance()->config.log.push_ratelimit; }
+char* pv_config_get_log_push_ratelimit_window() { return pv_get_instance()->config.log.push_ratelimit_window; }
 bool pv_config_get_log_capture() { return pv_get_instance()->config.log.capture; }
 bool pv_config_get_log_loggers() { return pv_get_instance()->config.log.loggers; }
 int pv_config_get_libthttp_loglevel() { return pv_get_instance()->config.libthttp.loglevel; }
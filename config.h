@@ -76,6 +76,7 @@ struct pantavisor_storage {
 	char *mnttype;
 	char *logtempsize;
 	int wait;
+	bool chunks;
 	struct pantavisor_gc gc;
 };
 
@@ -86,6 +87,19 @@ struct pantavisor_updater {
 	int revision_retries;
 	int revision_retry_timeout;
 	int commit_delay;
+	bool delta;
+	int download_workers;
+	int download_writeback;
+	int download_ratelimit;
+	char *download_ratelimit_window;
+	char *mirrors;
+	bool download_compression;
+	bool coalesce;
+	bool combined_query;
+};
+
+struct pantavisor_metadata {
+	int devmeta_interval;
 };
 
 struct pantavisor_bootloader {
@@ -111,6 +125,8 @@ struct pantavisor_log {
 	int loglevel;
 	int logsize;
 	bool push;
+	int push_ratelimit;
+	char *push_ratelimit_window;
 	bool capture;
 	bool loggers;
 };
@@ -144,6 +160,7 @@ struct pantavisor_config {
 	struct pantavisor_factory factory;
 	struct pantavisor_storage storage;
 	struct pantavisor_updater updater;
+	struct pantavisor_metadata metadata;
 	struct pantavisor_watchdog wdt;
 	struct pantavisor_network net;
 	struct pantavisor_log log;
@@ -187,6 +204,7 @@ char* pv_config_get_storage_mntpoint(void);
 char* pv_config_get_storage_mnttype(void);
 char* pv_config_get_storage_logtempsize(void);
 int pv_config_get_storage_wait(void);
+bool pv_config_get_storage_chunks(void);
 
 int pv_config_get_storage_gc_reserved(void);
 bool pv_config_get_storage_gc_keep_factory(void);
@@ -199,6 +217,17 @@ bool pv_config_get_updater_network_use_tmp_objects(void);
 int pv_config_get_updater_revision_retries(void);
 int pv_config_get_updater_revision_retry_timeout(void);
 int pv_config_get_updater_commit_delay(void);
+bool pv_config_get_updater_delta(void);
+int pv_config_get_updater_download_workers(void);
+int pv_config_get_updater_download_writeback(void);
+int pv_config_get_updater_download_ratelimit(void);
+char* pv_config_get_updater_download_ratelimit_window(void);
+char* pv_config_get_updater_mirrors(void);
+bool pv_config_get_updater_download_compression(void);
+bool pv_config_get_updater_coalesce(void);
+bool pv_config_get_updater_combined_query(void);
+
+int pv_config_get_metadata_devmeta_interval(void);
 
 int pv_config_get_bl_type(void);
 bool pv_config_get_bl_mtd_only(void);
@@ -216,6 +245,8 @@ int pv_config_get_log_logmax(void);
 int pv_config_get_log_loglevel(void);
 int pv_config_get_log_logsize(void);
 bool pv_config_get_log_push(void);
+int pv_config_get_log_push_ratelimit(void);
+char* pv_config_get_log_push_ratelimit_window(void);
 bool pv_config_get_log_capture(void);
 bool pv_config_get_log_loggers(void);
 int pv_config_get_libthttp_loglevel(void);
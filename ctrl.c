@@ -322,7 +322,9 @@ static int pv_ctrl_validate_object_checksum(char *file_path_tmp, char *file_path
 	if (!pv_storage_validate_file_checksum(file_path_tmp, sha)) {
 		pv_log(DEBUG, "renaming %s to %s...", file_path_tmp, file_path);
 		rename(file_path_tmp, file_path);
+		pv_objects_link_flat(sha);
 		syncdir(file_path);
+		pv_objects_catalog_add(sha);
 		return 0;
 	}
 
@@ -451,6 +453,23 @@ static char* pv_ctrl_get_file_path(const char* path, const char* file_name)
 	return file_path;
 }
 
+static char* pv_ctrl_get_object_tmp_path(const char* file_path)
+{
+	int len;
+	char* file_path_tmp;
+
+	if (!file_path)
+		return NULL;
+
+	len = strlen(PATH_OBJECTS_TMP) + strlen(file_path) + 1;
+	file_path_tmp = calloc(1, len * sizeof(char));
+	if (!file_path_tmp)
+		return NULL;
+	snprintf(file_path_tmp, len, PATH_OBJECTS_TMP, file_path);
+
+	return file_path_tmp;
+}
+
 static void pv_ctrl_process_get_string(int req_fd, char* buf)
 {
 	int buf_len;
@@ -471,6 +490,19 @@ static void pv_ctrl_process_get_string(int req_fd, char* buf)
 		free(buf);
 }
 
+static void pv_ctrl_process_get_objects(int req_fd)
+{
+	pv_log(DEBUG, "streaming object catalog to endpoint...");
+
+	if (write(req_fd, HTTP_RES_OK, sizeof(HTTP_RES_OK)-1) <= 0)
+		pv_log(WARN, "HTTP OK response could not be written to ctrl socket with fd %d: %s",
+			req_fd, strerror(errno));
+
+	if (pv_objects_catalog_write_json(req_fd))
+		pv_log(WARN, "HTTP GET content could not be written to ctrl socket with fd %d: %s",
+			req_fd, strerror(errno));
+}
+
 static char *pv_ctrl_get_body(int req_fd, size_t content_length)
 {
 	char *req = NULL;
@@ -607,16 +639,16 @@ static struct pv_cmd* pv_ctrl_read_parse_request(int req_fd)
 		}
 	} else if (pv_str_matches(ENDPOINT_OBJECTS, strlen(ENDPOINT_OBJECTS), path, path_len)) {
 		if (!strncmp("GET", method, method_len)) {
-			pv_ctrl_process_get_string(req_fd, pv_objects_get_list_string());
+			pv_ctrl_process_get_objects(req_fd);
 			goto out;
 		}
 	} else if (pv_str_startswith(ENDPOINT_OBJECTS, strlen(ENDPOINT_OBJECTS), path)) {
 		file_name = pv_ctrl_get_file_name(path, sizeof(ENDPOINT_OBJECTS), path_len);
-		file_path_tmp = pv_ctrl_get_file_path(PATH_OBJECTS_TMP, file_name);
-		file_path = pv_ctrl_get_file_path(PATH_OBJECTS, file_name);
-
 		// sha must have 64 characters
-		if (!file_name || !file_path_tmp || !file_path || (strlen(file_name) != 64)) {
+		file_path = pv_objects_get_path(file_name);
+		file_path_tmp = pv_ctrl_get_object_tmp_path(file_path);
+
+		if (!file_name || !file_path_tmp || !file_path) {
 			pv_log(WARN, "HTTP request has bad object name %s", file_name);
 			pv_ctrl_write_response(req_fd,
 				HTTP_STATUS_BAD_REQ,
@@ -625,6 +657,7 @@ static struct pv_cmd* pv_ctrl_read_parse_request(int req_fd)
 		}
 
 		if (!strncmp("PUT", method, method_len)) {
+			pv_objects_mkdir(file_name);
 			res = pv_ctrl_process_put_file(req_fd, content_length, file_path_tmp);
 			if (res < 0) {
 				goto out;
@@ -773,9 +806,29 @@ out:
 	return cmd;
 }
 
+struct pv_cmd* pv_ctrl_socket_accept(int ctrl_fd)
+{
+	int req_fd;
+	struct pv_cmd *cmd = NULL;
+
+	// create dedicated fd
+	req_fd = accept(ctrl_fd, 0, 0);
+	if (req_fd < 0) {
+		pv_log(WARN, "could not accept ctrl socket with fd %d: %s",
+			ctrl_fd, strerror(errno));
+		return NULL;
+	}
+
+	cmd = pv_ctrl_read_parse_request(req_fd);
+
+	close(req_fd);
+
+	return cmd;
+}
+
 struct pv_cmd* pv_ctrl_socket_wait(int ctrl_fd, int timeout)
 {
-	int req_fd = 0, ret;
+	int ret;
 	fd_set fdset;
 	struct timeval tv;
 	struct pv_cmd *cmd = NULL;
@@ -800,17 +853,7 @@ struct pv_cmd* pv_ctrl_socket_wait(int ctrl_fd, int timeout)
 		goto out;
 	}
 
-	// create dedicated fd
-	req_fd = accept(ctrl_fd, 0, 0);
-	if (req_fd < 0) {
-		pv_log(WARN, "could not accept ctrl socket with fd %d: %s",
-			ctrl_fd, strerror(errno));
-		goto out;
-	}
-
-	cmd = pv_ctrl_read_parse_request(req_fd);
-
-	close(req_fd);
+	cmd = pv_ctrl_socket_accept(ctrl_fd);
 out:
 	return cmd;
 }
@@ -26,6 +26,8 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "utils/list.h"
+
 typedef enum {
 	CMD_UPDATE_METADATA = 1,
 	CMD_REBOOT_DEVICE = 2,
@@ -40,8 +42,10 @@ typedef enum {
 struct pv_cmd {
 	pv_cmd_operation_t op;
 	char* payload;
+	struct dl_list list; // pv_cmd, while it waits to be run
 };
 
+struct pv_cmd* pv_ctrl_socket_accept(int ctrl_fd);
 struct pv_cmd* pv_ctrl_socket_wait(int ctrl_fd, int timeout);
 void pv_ctrl_free_cmd(struct pv_cmd *cmd);
 
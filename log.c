@@ -28,6 +28,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -66,6 +67,9 @@ static struct level_name level_names[] = {
 static char *log_dir = 0;
 static pid_t log_init_pid = -1;
 
+// file locks do not serialize threads of the same process
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static DEFINE_DL_LIST(log_buffer_list);
 static DEFINE_DL_LIST(log_buffer_list_double);
 static const int MAX_BUFFER_COUNT = 10;
@@ -162,6 +166,8 @@ static void __vlog(char *module, int level, const char *fmt, va_list args)
 
 	if (!log_dir)
 		return;
+
+	pthread_mutex_lock(&log_lock);
 	snprintf(log_path, sizeof(log_path), "%s/%s",log_dir, LOG_NAME);
 	log_fd = open(log_path, O_RDWR | O_APPEND | O_CREAT | O_SYNC, 0644);
 
@@ -202,6 +208,7 @@ static void __vlog(char *module, int level, const char *fmt, va_list args)
 				close(err_fd);
 			}
 			close(log_fd);
+			pthread_mutex_unlock(&log_lock);
 			return;
 		}
 	}
@@ -233,6 +240,7 @@ static void __vlog(char *module, int level, const char *fmt, va_list args)
 		pv_fops_unlock_file(log_fd);
 		close(log_fd);
 	}
+	pthread_mutex_unlock(&log_lock);
 }
 
 static void log_libthttp(int level, const char *fmt, va_list args)
@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <sys/stat.h>
 
@@ -54,11 +55,15 @@
 
 static const unsigned int METADATA_MAX_SIZE = 4096;
 
+// meta lists are shared by the network worker and the ctrl socket
+static pthread_mutex_t metadata_lock = PTHREAD_MUTEX_INITIALIZER;
+
 #define PV_USERMETA_ADD     (1<<0)
 struct pv_meta {
 	char *key;
 	char *value;
 	bool updated;
+	bool uploading;
 	struct dl_list list; // pv_meta
 };
 
@@ -250,6 +255,11 @@ static void pv_usermeta_remove(struct pv_metadata *metadata)
 		dl_list_del(&curr->list);
 		pv_metadata_free(curr);
 	}
+
+	if (metadata->usermeta_last) {
+		free(metadata->usermeta_last);
+		metadata->usermeta_last = NULL;
+	}
 }
 
 static void pv_devmeta_remove(struct pv_metadata *metadata)
@@ -333,7 +343,7 @@ out:
 	return ret;
 }
 
-int pv_metadata_add_usermeta(const char *key, const char *value)
+static int __pv_metadata_add_usermeta(const char *key, const char *value)
 {
 	struct pantavisor *pv = pv_get_instance();
 	struct pv_meta *curr;
@@ -358,7 +368,18 @@ int pv_metadata_add_usermeta(const char *key, const char *value)
 	return -1;
 }
 
-int pv_metadata_rm_usermeta(const char *key)
+int pv_metadata_add_usermeta(const char *key, const char *value)
+{
+	int ret;
+
+	pthread_mutex_lock(&metadata_lock);
+	ret = __pv_metadata_add_usermeta(key, value);
+	pthread_mutex_unlock(&metadata_lock);
+
+	return ret;
+}
+
+static int __pv_metadata_rm_usermeta(const char *key)
 {
 	struct pantavisor *pv = pv_get_instance();
 	struct pv_meta *meta;
@@ -376,6 +397,17 @@ int pv_metadata_rm_usermeta(const char *key)
 	return -1;
 }
 
+int pv_metadata_rm_usermeta(const char *key)
+{
+	int ret;
+
+	pthread_mutex_lock(&metadata_lock);
+	ret = __pv_metadata_rm_usermeta(key);
+	pthread_mutex_unlock(&metadata_lock);
+
+	return ret;
+}
+
 static int pv_usermeta_parse(struct pantavisor *pv, char *buf)
 {
 	int ret = 0, tokc, n;
@@ -392,6 +424,16 @@ static int pv_usermeta_parse(struct pantavisor *pv, char *buf)
 		goto out;
 	}
 
+	// nothing to apply if user-meta did not change since last time
+	if (pv->metadata->usermeta_last &&
+		!strcmp(pv->metadata->usermeta_last, um)) {
+		ret = 1;
+		goto out;
+	}
+	if (pv->metadata->usermeta_last)
+		free(pv->metadata->usermeta_last);
+	pv->metadata->usermeta_last = strdup(um);
+
 	if (tokv)
 		free(tokv);
 
@@ -422,7 +464,7 @@ static int pv_usermeta_parse(struct pantavisor *pv, char *buf)
 		// add or update metadata
 		// primitives with value 'null' have value NULL
 		if ((*key_i+1)->type != JSMN_PRIMITIVE || strcmp("null", value))
-			pv_metadata_add_usermeta(key, value);
+			__pv_metadata_add_usermeta(key, value);
 
 		// free intermediates
 		if (key) {
@@ -438,6 +480,7 @@ static int pv_usermeta_parse(struct pantavisor *pv, char *buf)
 	}
 
 	jsmnutil_tokv_free(keys);
+	ret = 0;
 
 out:
 	if (um)
@@ -466,7 +509,7 @@ static void usermeta_clear(struct pantavisor *pv)
 			curr->updated = false;
 		// not updated means user meta is no longer in cloud
 		else
-			pv_metadata_rm_usermeta(curr->key);
+			__pv_metadata_rm_usermeta(curr->key);
 	}
 }
 
@@ -474,8 +517,10 @@ void pv_metadata_add_devmeta(const char *key, const char *value)
 {
 	struct pantavisor *pv = pv_get_instance();
 	struct pv_meta *curr;
-	int ret = pv_metadata_add(&pv->metadata->devmeta, key, value);
+	int ret;
 
+	pthread_mutex_lock(&metadata_lock);
+	ret = pv_metadata_add(&pv->metadata->devmeta, key, value);
 	if (ret > 0) {
 		// set updated flag only for added or updated so they can be uploaded
 		curr = pv_metadata_get_by_key(&pv->metadata->devmeta, key);
@@ -485,6 +530,7 @@ void pv_metadata_add_devmeta(const char *key, const char *value)
 		pv_log(DEBUG, "device metadata key %s added or updated", key);
 		pv->metadata->devmeta_uploaded = false;
 	}
+	pthread_mutex_unlock(&metadata_lock);
 }
 
 void pv_metadata_parse_devmeta(const char *buf)
@@ -568,30 +614,27 @@ int pv_metadata_init_devmeta(struct pantavisor *pv)
 
 int pv_metadata_upload_devmeta(struct pantavisor *pv)
 {
-	unsigned int len = 0;
-	char *json = NULL;
+	struct pv_json_buf json;
 	struct pv_meta *info = NULL, *tmp = NULL;
 	struct dl_list *head = NULL;
-	int json_avail = 0, ret = 0;
-	struct log_buffer *log_buffer = NULL;
-	/*
-	 * we can use one of the large log_buffer. Since
-	 * this information won't be very large, it's safe
-	 * to assume even the complete json would
-	 * be small enough to fit inside this log_buffer.
-	 */
-	log_buffer = pv_log_get_buffer(true);
-	if (!log_buffer) {
+	int count = 0, ret = 0;
+
+	pthread_mutex_lock(&metadata_lock);
+
+	if (pv->metadata->devmeta_uploaded)
+		goto unlock;
+
+	// changes that come in a burst go together in the next upload
+	if (!timer_current_state(&pv->metadata->devmeta_timer).fin)
+		goto unlock;
+
+	if (pv_json_buf_init(&json, 1024)) {
 		pv_log(INFO, "couldn't allocate buffer to upload device info");
+		pthread_mutex_unlock(&metadata_lock);
 		return -1;
 	}
 
-	if (pv->metadata->devmeta_uploaded)
-		goto out;
-	json = log_buffer->buf;
-	json_avail = log_buffer->size;
-	json_avail -= sprintf(json, "{");
-	len += 1;
+	pv_json_buf_printf(&json, "{");
 	head = &pv->metadata->devmeta;
 	dl_list_for_each_safe(info, tmp, head,
 			struct pv_meta, list) {
@@ -603,105 +646,96 @@ int pv_metadata_upload_devmeta(struct pantavisor *pv)
 
 		if (key && val) {
 			// if value is a regular string
-			if (info->value[0] != '{') {
-				int frag_len = strlen(key) + strlen(val) +
-					// 2 pairs of quotes
-					2 * 2 +
-					// 1 colon and a ,
-					1 + 1;
-				if (json_avail > frag_len) {
-					snprintf(json + len, json_avail,
-							"\"%s\":\"%s\",",
-							key, val);
-					len += frag_len;
-					json_avail -= frag_len;
-				}
+			if (info->value[0] != '{')
+				ret = pv_json_buf_printf(&json, "%s\"%s\":\"%s\"",
+						count ? "," : "", key, val);
 			// if value is a json
-			} else {
-				int frag_len = strlen(info->key) + strlen(info->value) +
-					// 1 pair of quotes
-					1 * 2 +
-					// 1 colon and a ,
-					1 + 1;
-				if (json_avail > frag_len) {
-					snprintf(json + len, json_avail,
-							"\"%s\":%s,",
-							info->key, info->value);
-					len += frag_len;
-					json_avail -= frag_len;
-				}
-			}
+			else
+				ret = pv_json_buf_printf(&json, "%s\"%s\":%s",
+						count ? "," : "", info->key, info->value);
+			info->uploading = true;
+			count++;
 		}
 		if (key)
 			free(key);
 		if (val)
 			free(val);
+		if (ret < 0)
+			goto out;
 	}
-	/*
-	 * replace , with closing brace.
-	 */
-	json[len - 1] = '}';
-	pv_log(INFO, "uploading devmeta json '%s'", json);
-	ret = pv_ph_upload_metadata(pv, json);
-	if(!ret) {
-		pv->metadata->devmeta_uploaded = true;
+	ret = pv_json_buf_printf(&json, "}");
+	if (ret < 0)
+		goto out;
 
-		dl_list_for_each_safe(info, tmp, head,
+	ret = 0;
+	if (!count)
+		goto out;
+
+	// keys changed while uploading get flagged again for the next one
+	pv->metadata->devmeta_uploaded = true;
+	dl_list_for_each_safe(info, tmp, head,
 			struct pv_meta, list) {
+		if (info->uploading)
 			info->updated = false;
-		}
 	}
+
+	// do not keep the lists locked during the request
+	pthread_mutex_unlock(&metadata_lock);
+	pv_log(INFO, "uploading devmeta json '%s'", json.buf);
+	ret = pv_ph_upload_metadata(pv, json.buf);
+	pthread_mutex_lock(&metadata_lock);
+
+	if (!ret)
+		timer_start(&pv->metadata->devmeta_timer,
+			pv_config_get_metadata_devmeta_interval(), 0, RELATIV_TIMER);
+	else
+		pv->metadata->devmeta_uploaded = false;
 out:
-	pv_log_put_buffer(log_buffer);
-	return 0;
+	dl_list_for_each_safe(info, tmp, head,
+			struct pv_meta, list) {
+		if (ret && info->uploading)
+			info->updated = true;
+		info->uploading = false;
+	}
+	pv_json_buf_free(&json);
+unlock:
+	pthread_mutex_unlock(&metadata_lock);
+	return ret;
 }
 
 /*
  * For iteration over config items.
  */
-struct json_buf {
-	char *buf;
+struct factory_json {
+	struct pv_json_buf json;
 	const char *factory_file;
-	int len;
-	int avail;
+	int count;
 };
 /*
- * opaque is the json buffer.
+ * opaque is the factory json.
  */
 static int on_factory_meta_iterate(char *key, char *value, void *opaque)
 {
-	struct json_buf *json_buf = (struct json_buf*) opaque;
+	struct factory_json *factory_json = (struct factory_json*) opaque;
 	char abs_key[PATH_MAX + (PATH_MAX / 2)];
 	char *formatted_key = NULL;
 	char *formatted_val = NULL;
-	int json_avail = json_buf->avail;
-	int len = json_buf->len;
 	bool written = false;
 	char file[PATH_MAX];
 	char *fname = NULL;
 
-	strcpy(file, json_buf->factory_file);
+	strcpy(file, factory_json->factory_file);
 	fname = basename(file);
 	snprintf(abs_key, sizeof(abs_key), "factory/%s/%s", fname, key);
 	formatted_key = pv_json_format(abs_key, strlen(abs_key));
 	formatted_val = pv_json_format(value, strlen(value));
 
-	if (formatted_key && formatted_val) {
-		int frag_len = strlen(formatted_key) + strlen(formatted_val) +
-			/* 2 pairs of quotes*/
-			2 * 2 +
-			/* 1 colon and a ,*/
-			1 + 1;
-		if (json_avail > frag_len) {
-			snprintf(json_buf->buf + len, json_avail,
-					"\"%s\":\"%s\",",
-					formatted_key, formatted_val);
-			len += frag_len;
-			json_avail -= frag_len;
-			json_buf->len = len;
-			json_buf->avail = json_avail;
-			written = true;
-		}
+	if (formatted_key && formatted_val &&
+		(pv_json_buf_printf(&factory_json->json, "%s\"%s\":\"%s\"",
+			factory_json->count ? "," : "",
+			formatted_key, formatted_val) >= 0)) {
+		factory_json->count++;
+		written = true;
 	}
 	if (formatted_key)
 		free(formatted_key);
@@ -714,41 +748,28 @@ static int __pv_metadata_factory_meta(struct pantavisor *pv, const char *factory
 {
 	int ret = -1;
 	DEFINE_DL_LIST(factory_kv_list);
-	struct log_buffer *log_buffer = NULL;
-	char *json_holder = NULL;
-	int json_len = 0;
-	int json_avail = 0;
-	struct json_buf json_buf;
+	struct factory_json factory_json;
 
 	if (!factory_file)
 		goto out;
 	ret = load_key_value_file(factory_file, &factory_kv_list);
 	if (ret < 0)
 		goto out;
-	log_buffer = pv_log_get_buffer(true);
-	if (!log_buffer)
-		goto out;
+	ret = -1;
+	if (pv_json_buf_init(&factory_json.json, 1024))
+		goto clear;
 
-	json_holder = log_buffer->buf;
-	json_avail = log_buffer->size;
-	json_avail -= sprintf(json_holder, "{");
-	json_len += 1;
-
-	json_buf.buf = json_holder;
-	json_buf.len = json_len;
-	json_buf.avail = json_avail;
-	json_buf.factory_file = factory_file;
+	factory_json.factory_file = factory_file;
+	factory_json.count = 0;
+	pv_json_buf_printf(&factory_json.json, "{");
 	config_iterate_items(&factory_kv_list,
-			on_factory_meta_iterate, &json_buf);
-	json_len = json_buf.len;
-	/*
-	 * replace last ,.
-	 */
-	json_holder[json_len - 1] = '}';
+			on_factory_meta_iterate, &factory_json);
+	pv_json_buf_printf(&factory_json.json, "}");
 
-	ret = pv_ph_upload_metadata(pv, json_holder);
-	pv_log_put_buffer(log_buffer);
-	pv_log(INFO, "metadata_json : %s", json_holder);
+	ret = pv_ph_upload_metadata(pv, factory_json.json.buf);
+	pv_log(INFO, "metadata_json : %s", factory_json.json.buf);
+	pv_json_buf_free(&factory_json.json);
+clear:
 	config_clear_items(&factory_kv_list);
 out:
 	return ret;
@@ -806,17 +827,22 @@ void pv_metadata_parse_usermeta(char *buf)
 {
 	struct pantavisor *pv = pv_get_instance();
 	char *body, *esc;
+	int ret;
 
 	body = strdup(buf);
 	esc = pv_str_unescape_to_ascii(body, "\\n", '\n');
-	pv_usermeta_parse(pv, esc);
+
+	pthread_mutex_lock(&metadata_lock);
+	ret = pv_usermeta_parse(pv, esc);
 
 	if (body)
 		free(body);
 	if (esc)
 		free(esc);
 	// clear old
-	usermeta_clear(pv);
+	if (ret != 1)
+		usermeta_clear(pv);
+	pthread_mutex_unlock(&metadata_lock);
 }
 
 static struct pv_meta* pv_metadata_get_usermeta(struct pantavisor *pv, char *key)
@@ -878,6 +904,7 @@ static int pv_metadata_init(struct pv_init *this)
 	dl_list_init(&pv->metadata->devmeta);
 
 	pv->metadata->devmeta_uploaded = true;
+	timer_start(&pv->metadata->devmeta_timer, 0, 0, RELATIV_TIMER);
 
 	pv_metadata_load_usermeta();
 
@@ -954,12 +981,24 @@ out:
 
 char* pv_metadata_get_user_meta_string()
 {
-	return pv_metadata_get_meta_string(&pv_get_instance()->metadata->usermeta);
+	char *json;
+
+	pthread_mutex_lock(&metadata_lock);
+	json = pv_metadata_get_meta_string(&pv_get_instance()->metadata->usermeta);
+	pthread_mutex_unlock(&metadata_lock);
+
+	return json;
 }
 
 char* pv_metadata_get_device_meta_string()
 {
-	return pv_metadata_get_meta_string(&pv_get_instance()->metadata->devmeta);
+	char *json;
+
+	pthread_mutex_lock(&metadata_lock);
+	json = pv_metadata_get_meta_string(&pv_get_instance()->metadata->devmeta);
+	pthread_mutex_unlock(&metadata_lock);
+
+	return json;
 }
 
 void pv_metadata_remove()
@@ -25,6 +25,7 @@
 #include <stdbool.h>
 
 #include "pantavisor.h"
+#include "utils/timer.h"
 
 #define DEVMETA_KEY_INTERFACES "interfaces"
 #define DEVMETA_KEY_PH_CLAIMED "pantahub.claimed"
@@ -37,12 +38,15 @@
 #define DEVMETA_KEY_PV_MODE "pantavisor.mode"
 #define DEVMETA_KEY_PV_REVISION "pantavisor.revision"
 #define DEVMETA_KEY_PV_VERSION "pantavisor.version"
+#define DEVMETA_KEY_PV_DOWNLOAD_THROUGHPUT "pantavisor.download.throughput"
 
 
 struct pv_metadata {
 	struct dl_list usermeta; // pv_meta
 	struct dl_list devmeta; // pv_meta
 	bool devmeta_uploaded;
+	struct timer devmeta_timer;
+	char *usermeta_last;
 };
 
 int pv_metadata_factory_meta(struct pantavisor *pv);
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2017 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "mirrors.h"
+
+#define MODULE_NAME			"mirrors"
+#define pv_log(level, msg, ...)		vlog(MODULE_NAME, level, msg, ## __VA_ARGS__)
+#include "log.h"
+
+static DEFINE_DL_LIST(mirrors);
+static char *mirrors_config = NULL;
+// download workers share the health of each mirror
+static pthread_mutex_t mirrors_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void pv_mirrors_free(void)
+{
+	struct pv_mirror *m, *tmp;
+
+	dl_list_for_each_safe(m, tmp, &mirrors,
+			struct pv_mirror, list) {
+		dl_list_del(&m->list);
+		free(m->url);
+		free(m);
+	}
+
+	if (mirrors_config) {
+		free(mirrors_config);
+		mirrors_config = NULL;
+	}
+}
+
+void pv_mirrors_load(const char *config)
+{
+	struct pv_mirror *m;
+	char *list, *url, *saveptr = NULL;
+	int len;
+
+	if ((!config && !mirrors_config) ||
+		(config && mirrors_config && !strcmp(config, mirrors_config)))
+		return;
+
+	pv_mirrors_free();
+	if (!config)
+		return;
+
+	mirrors_config = strdup(config);
+	list = strdup(config);
+	if (!list)
+		return;
+
+	for (url = strtok_r(list, " ,", &saveptr); url; url = strtok_r(NULL, " ,", &saveptr)) {
+		if (strncmp(url, "https://", strlen("https://")) &&
+			strncmp(url, "http://", strlen("http://")) &&
+			strncmp(url, "file://", strlen("file://"))) {
+			pv_log(WARN, "ignoring mirror with unsupported url %s", url);
+			continue;
+		}
+
+		m = calloc(1, sizeof(struct pv_mirror));
+		if (!m)
+			break;
+		m->url = strdup(url);
+		if (!m->url) {
+			free(m);
+			break;
+		}
+		len = strlen(m->url);
+		while ((len > 0) && (m->url[len - 1] == '/'))
+			m->url[--len] = '\0';
+
+		dl_list_init(&m->list);
+		dl_list_add_tail(&mirrors, &m->list);
+		pv_log(DEBUG, "using mirror %s", m->url);
+	}
+
+	free(list);
+}
+
+struct dl_list* pv_mirrors_get(void)
+{
+	return &mirrors;
+}
+
+bool pv_mirror_is_available(struct pv_mirror *m)
+{
+	bool ret;
+
+	pthread_mutex_lock(&mirrors_lock);
+	ret = !m->failures || timer_current_state(&m->retry).fin;
+	pthread_mutex_unlock(&mirrors_lock);
+
+	return ret;
+}
+
+int pv_mirror_set_result(struct pv_mirror *m, bool ok)
+{
+	int secs = 0;
+
+	pthread_mutex_lock(&mirrors_lock);
+
+	if (ok) {
+		m->failures = 0;
+		goto out;
+	}
+
+	if (m->failures < 16)
+		m->failures++;
+	secs = MIRROR_RETRY_MIN << (m->failures - 1);
+	if (secs > MIRROR_RETRY_MAX)
+		secs = MIRROR_RETRY_MAX;
+	timer_start(&m->retry, secs, 0, RELATIV_TIMER);
+
+	pv_log(WARN, "mirror %s failed %d times in a row, skipping it for %d seconds",
+		m->url, m->failures, secs);
+
+out:
+	pthread_mutex_unlock(&mirrors_lock);
+
+	return secs;
+}
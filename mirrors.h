@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2017 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef PV_MIRRORS_H
+#define PV_MIRRORS_H
+
+#include <stdbool.h>
+
+#include "utils/list.h"
+#include "utils/timer.h"
+
+// a failing mirror is skipped for twice as long each time, up to the max
+#define MIRROR_RETRY_MIN	30
+#define MIRROR_RETRY_MAX	(30 * 60)
+
+/*
+ * Mirrors serve objects by sha256 under a base url. They are consulted in
+ * the configured order before the signed url
+ */
+struct pv_mirror {
+	char *url;
+	int failures;
+	struct timer retry;
+	struct dl_list list; // pv_mirror
+};
+
+/*
+ * Parses a list of base urls separated by spaces or commas. Health is kept
+ * while the list does not change. The list must not be in use by other
+ * threads while it is loaded
+ */
+void pv_mirrors_load(const char *config);
+void pv_mirrors_free(void);
+
+struct dl_list* pv_mirrors_get(void);
+
+bool pv_mirror_is_available(struct pv_mirror *m);
+// returns the seconds the mirror will be skipped for, 0 if ok
+int pv_mirror_set_result(struct pv_mirror *m, bool ok);
+
+#endif // PV_MIRRORS_H
@@ -25,18 +25,359 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
 
 #include <linux/limits.h>
 
-#include "utils/math.h"
 #include "objects.h"
 #include "state.h"
 #include "storage.h"
+#include "config.h"
+#include "utils/fops.h"
+#include "utils/fs.h"
+#include "utils/json.h"
+#include "utils/timer.h"
 
 #define MODULE_NAME			"objects"
 #define pv_log(level, msg, ...)		vlog(MODULE_NAME, level, msg, ## __VA_ARGS__)
 #include "log.h"
 
+// in-memory view of the objects pool, loaded once and kept up to date by
+// the updater, ctrl and garbage collector, which can run in different threads.
+// Entries are hashed by the first 3 hex digits of their sha256
+#define CATALOG_BUCKETS	4096
+static struct dl_list catalog[CATALOG_BUCKETS];
+static int catalog_count = 0;
+static bool catalog_loaded = false;
+static pthread_mutex_t catalog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// objects used to live in a flat objects/ dir. They are moved into
+// objects/<2 first chars of sha>/ in background until migrated is set.
+// objects/<sha> is kept as a symlink into the shard, so tools that look
+// for objects in the flat dir, like pvr with .pvr/config, still find them
+static int migrated = -1;
+
+static bool pv_objects_is_id(const char *name)
+{
+	int i;
+
+	for (i = 0; name[i]; i++) {
+		if (!isxdigit(name[i]))
+			return false;
+	}
+
+	return (i == 64);
+}
+
+static bool pv_objects_is_shard(const char *name)
+{
+	return (strlen(name) == 2) && isxdigit(name[0]) && isxdigit(name[1]);
+}
+
+// true for objects still in the flat layout, not for their links
+static bool pv_objects_is_flat(const char *path)
+{
+	struct stat st;
+
+	return !lstat(path, &st) && S_ISREG(st.st_mode);
+}
+
+bool pv_objects_is_migrated(void)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (migrated < 0) {
+		snprintf(path, sizeof(path), OBJMIGRATED_FMT,
+			pv_config_get_storage_mntpoint());
+		migrated = !stat(path, &st);
+	}
+
+	return migrated;
+}
+
+/*
+ * Returns the path of the object in the pool. While the migration is not
+ * over, objects still in the flat layout are returned with their old path
+ */
+char* pv_objects_get_path(const char *id)
+{
+	char *path;
+	int len;
+	const char *mntpoint = pv_config_get_storage_mntpoint();
+
+	if (!id || !pv_objects_is_id(id))
+		return NULL;
+
+	len = sizeof(OBJPATH_FMT) + strlen(mntpoint) + strlen(id);
+	path = calloc(1, len * sizeof(char));
+	if (!path)
+		return NULL;
+
+	if (!pv_objects_is_migrated()) {
+		snprintf(path, len, OBJPATH_FLAT_FMT, mntpoint, id);
+		if (pv_objects_is_flat(path))
+			return path;
+	}
+
+	snprintf(path, len, OBJPATH_FMT, mntpoint, id, id);
+
+	return path;
+}
+
+int pv_objects_mkdir(const char *id)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), OBJSHARD_FMT,
+		pv_config_get_storage_mntpoint(), id);
+
+	if (mkdir(path, 0755) && (errno != EEXIST)) {
+		pv_log(ERROR, "cannot create %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Points objects/<id> to the object in its shard. Called once the object
+ * is in place
+ */
+int pv_objects_link_flat(const char *id)
+{
+	char path[PATH_MAX], target[PATH_MAX];
+
+	snprintf(path, sizeof(path), OBJPATH_FLAT_FMT,
+		pv_config_get_storage_mntpoint(), id);
+	snprintf(target, sizeof(target), OBJLINK_FMT, id, id);
+
+	if (symlink(target, path) && (errno != EEXIST)) {
+		pv_log(WARN, "cannot link %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int pv_objects_add_id(struct dl_list *ids, const char *id)
+{
+	struct pv_path *p;
+
+	p = calloc(1, sizeof(struct pv_path));
+	if (!p)
+		return -1;
+
+	p->path = strdup(id);
+	if (!p->path) {
+		free(p);
+		return -1;
+	}
+
+	dl_list_init(&p->list);
+	dl_list_add_tail(ids, &p->list);
+
+	return 0;
+}
+
+/*
+ * Fills ids with a struct pv_path per object found in the pool, no matter
+ * if it is still in the flat layout or already in its shard. Temporary
+ * and foreign files are skipped
+ */
+int pv_objects_get_ids(struct dl_list *ids)
+{
+	DIR *d, *sd;
+	struct dirent *dir, *sdir;
+	char path[PATH_MAX];
+	int ret = 0;
+
+	snprintf(path, sizeof(path), OBJDIR_FMT, pv_config_get_storage_mntpoint());
+	d = opendir(path);
+	if (!d) {
+		pv_log(WARN, "cannot open %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	while ((dir = readdir(d)) != NULL) {
+		if (pv_objects_is_id(dir->d_name)) {
+			snprintf(path, sizeof(path), OBJPATH_FLAT_FMT,
+				pv_config_get_storage_mntpoint(), dir->d_name);
+			if (pv_objects_is_flat(path) &&
+				pv_objects_add_id(ids, dir->d_name))
+				ret = -1;
+			continue;
+		}
+
+		if (!pv_objects_is_shard(dir->d_name))
+			continue;
+
+		snprintf(path, sizeof(path), OBJSHARD_FMT,
+			pv_config_get_storage_mntpoint(), dir->d_name);
+		sd = opendir(path);
+		if (!sd)
+			continue;
+
+		while ((sdir = readdir(sd)) != NULL) {
+			if (!pv_objects_is_id(sdir->d_name) ||
+				strncmp(sdir->d_name, dir->d_name, 2))
+				continue;
+			if (pv_objects_add_id(ids, sdir->d_name))
+				ret = -1;
+		}
+		closedir(sd);
+	}
+	closedir(d);
+
+	return ret;
+}
+
+static bool pv_objects_is_leftover(const char *name, const char *path)
+{
+	struct stat st;
+
+	if (!strcmp(name, ".sharded"))
+		return false;
+
+	// links to objects that were removed
+	if (pv_objects_is_id(name))
+		return !lstat(path, &st) && S_ISLNK(st.st_mode) && stat(path, &st);
+
+	return !stat(path, &st) && S_ISREG(st.st_mode);
+}
+
+/*
+ * Fills paths with a struct pv_path per file in the pool that is not an
+ * object, both in the flat layout and in the shards. These are what
+ * interrupted or abandoned downloads leave behind: tmp, state, delta...
+ * and the flat links of removed objects
+ */
+int pv_objects_get_leftovers(struct dl_list *paths)
+{
+	DIR *d, *sd;
+	struct dirent *dir, *sdir;
+	char path[PATH_MAX], spath[PATH_MAX];
+	const char *mntpoint = pv_config_get_storage_mntpoint();
+	int ret = 0;
+
+	snprintf(path, sizeof(path), OBJDIR_FMT, mntpoint);
+	d = opendir(path);
+	if (!d) {
+		pv_log(WARN, "cannot open %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	while ((dir = readdir(d)) != NULL) {
+		if (pv_objects_is_shard(dir->d_name)) {
+			snprintf(path, sizeof(path), OBJSHARD_FMT, mntpoint, dir->d_name);
+			sd = opendir(path);
+			if (!sd)
+				continue;
+
+			while ((sdir = readdir(sd)) != NULL) {
+				snprintf(spath, sizeof(spath), "%s/%s", path, sdir->d_name);
+				if (pv_objects_is_leftover(sdir->d_name, spath) &&
+					pv_objects_add_id(paths, spath))
+					ret = -1;
+			}
+			closedir(sd);
+			continue;
+		}
+
+		snprintf(path, sizeof(path), OBJPATH_FLAT_FMT, mntpoint, dir->d_name);
+		if (pv_objects_is_leftover(dir->d_name, path) &&
+			pv_objects_add_id(paths, path))
+			ret = -1;
+	}
+	closedir(d);
+
+	return ret;
+}
+
+/*
+ * Moves objects from the flat layout into their shards for up to max_ms,
+ * leaving a link behind. rename keeps the inode, so hardlinks from trails
+ * stay intact. The pool is synced once per call, a crash in between leaves
+ * each object either in the flat layout or in its shard. Once no flat
+ * object is left, a marker is written so this is not done again
+ */
+void pv_objects_migrate(int max_ms)
+{
+	DIR *d;
+	struct dirent *dir;
+	struct timer t;
+	char path[PATH_MAX], new_path[PATH_MAX];
+	const char *mntpoint = pv_config_get_storage_mntpoint();
+	int fd, n = 0;
+	bool pending = false;
+
+	if (pv_objects_is_migrated())
+		return;
+
+	snprintf(path, sizeof(path), OBJDIR_FMT, mntpoint);
+	d = opendir(path);
+	if (!d)
+		return;
+
+	timer_start(&t, max_ms / 1000, (max_ms % 1000) * 1000000, RELATIV_TIMER);
+
+	while ((dir = readdir(d)) != NULL) {
+		if (!pv_objects_is_id(dir->d_name))
+			continue;
+
+		snprintf(path, sizeof(path), OBJPATH_FLAT_FMT, mntpoint, dir->d_name);
+		if (!pv_objects_is_flat(path))
+			continue;
+
+		if (timer_current_state(&t).fin) {
+			pending = true;
+			break;
+		}
+
+		if (pv_objects_mkdir(dir->d_name)) {
+			pending = true;
+			break;
+		}
+
+		snprintf(new_path, sizeof(new_path), OBJPATH_FMT,
+			mntpoint, dir->d_name, dir->d_name);
+		if (rename(path, new_path)) {
+			pv_log(WARN, "cannot move %s to %s: %s", path, new_path, strerror(errno));
+			pending = true;
+			continue;
+		}
+		pv_objects_link_flat(dir->d_name);
+		n++;
+	}
+	closedir(d);
+
+	if (n) {
+		syncfs_path((char *) mntpoint);
+		pv_log(DEBUG, "moved %d objects into sharded layout", n);
+	}
+
+	if (pending)
+		return;
+
+	snprintf(path, sizeof(path), OBJMIGRATED_FMT, mntpoint);
+	fd = open(path, O_CREAT | O_WRONLY | O_SYNC, 0644);
+	if (fd < 0) {
+		pv_log(WARN, "cannot create %s: %s", path, strerror(errno));
+		return;
+	}
+	close(fd);
+	syncdir(path);
+
+	migrated = 1;
+	pv_log(INFO, "objects migrated to sharded layout");
+}
+
 int pv_objects_id_in_step(struct pv_state *s, char *id)
 {
 	struct pv_object *curr, *tmp;
@@ -73,12 +414,8 @@ struct pv_object* pv_objects_add(struct pv_state *s, char *filename, char *id, c
 			goto free_object;
 
 		// init objpath
-		size = sizeof(OBJPATH_FMT) + strlen(mntpoint) + strlen(id);
-
-		this->objpath = calloc(1, size * sizeof(char));
-		if (this->objpath)
-			sprintf(this->objpath, OBJPATH_FMT, mntpoint, id);
-		else
+		this->objpath = pv_objects_get_path(id);
+		if (!this->objpath)
 			goto free_object;
 
 		dl_list_init(&this->list);
@@ -125,54 +462,214 @@ void pv_objects_empty(struct pv_state *s)
 	pv_log(INFO, "removed %d objects", num_obj);
 }
 
-char *pv_objects_get_list_string()
+static struct dl_list* pv_objects_catalog_bucket(const char *id)
 {
-	struct dl_list objects; // pv_path
-	char path[PATH_MAX];
-	struct pv_path *curr, *tmp;
-	int len = 1, line_len;
-	char *json = calloc(1, len);
-	unsigned int size_object;
+	char prefix[4];
+
+	// ids are checked to be hex before they get here
+	snprintf(prefix, sizeof(prefix), "%s", id);
+	return &catalog[strtoul(prefix, NULL, 16) % CATALOG_BUCKETS];
+}
+
+static struct pv_object_entry* pv_objects_catalog_get(const char *id)
+{
+	struct pv_object_entry *curr, *tmp;
+
+	dl_list_for_each_safe(curr, tmp, pv_objects_catalog_bucket(id),
+			struct pv_object_entry, list) {
+		if (!strcmp(curr->id, id))
+			return curr;
+	}
+	return NULL;
+}
+
+static void pv_objects_catalog_set(const char *id, struct stat *st)
+{
+	struct pv_object_entry *e;
+
+	e = pv_objects_catalog_get(id);
+	if (!e) {
+		e = calloc(1, sizeof(struct pv_object_entry));
+		if (!e)
+			return;
+		e->id = strdup(id);
+		if (!e->id) {
+			free(e);
+			return;
+		}
+		dl_list_init(&e->list);
+		dl_list_add_tail(pv_objects_catalog_bucket(id), &e->list);
+		catalog_count++;
+	}
+
+	e->size = st->st_size;
+	// first link belongs to the pool itself
+	e->refcount = st->st_nlink - 1;
+}
 
-	sprintf(path, "%s/objects/", pv_config_get_storage_mntpoint());
+static void pv_objects_catalog_load(void)
+{
+	struct stat st;
+	struct pv_path *p, *tmp;
+	char *path;
+	int i, n = 0;
+	DEFINE_DL_LIST(ids);
 
-	dl_list_init(&objects);
-	pv_storage_get_subdir(path, "", &objects);
+	if (catalog_loaded)
+		return;
 
-	// open json
-	json[0]='[';
+	for (i = 0; i < CATALOG_BUCKETS; i++)
+		dl_list_init(&catalog[i]);
+	catalog_count = 0;
 
-	if (dl_list_empty(&objects)) {
-		len++;
+	if (pv_objects_get_ids(&ids))
 		goto out;
+
+	dl_list_for_each_safe(p, tmp, &ids, struct pv_path, list) {
+		path = pv_objects_get_path(p->path);
+		if (path && !stat(path, &st) && (st.st_size > 0)) {
+			pv_objects_catalog_set(p->path, &st);
+			n++;
+		}
+		free(path);
 	}
 
-	// add object info to json
-	dl_list_for_each_safe(curr, tmp, &objects,
-		struct pv_path, list) {
+	catalog_loaded = true;
+	pv_log(DEBUG, "loaded %d objects into catalog", n);
 
-		// if not sha256 string ... skip
-		if (strlen(curr->path) != 64)
-			continue;
+out:
+	pv_storage_free_subdir(&ids);
+}
 
-		sprintf(path, "%s/objects/%s", pv_config_get_storage_mntpoint(), curr->path);
-		size_object = pv_storage_get_file_size(path);
-		if (size_object <= 0)
-			continue;
+void pv_objects_catalog_add(const char *id)
+{
+	struct stat st;
+	char *path;
+
+	if (!id || !pv_objects_is_id(id))
+		return;
+
+	pthread_mutex_lock(&catalog_lock);
+
+	// first access will scan the pool, which already includes this object
+	if (!catalog_loaded) {
+		pv_objects_catalog_load();
+		goto out;
+	}
+
+	path = pv_objects_get_path(id);
+	if (path && !stat(path, &st) && (st.st_size > 0))
+		pv_objects_catalog_set(id, &st);
+
+	free(path);
+out:
+	pthread_mutex_unlock(&catalog_lock);
+}
+
+void pv_objects_catalog_link(const char *id)
+{
+	struct pv_object_entry *e;
 
-		line_len = strlen(curr->path) + get_digit_count(size_object) + 26;
-		json = realloc(json, len + line_len + 1);
-		snprintf(&json[len], line_len + 1, "{\"sha256\": \"%s\", \"size\": \"%d\"},", curr->path, size_object);
-		len += line_len;
+	if (!id)
+		return;
+
+	pthread_mutex_lock(&catalog_lock);
+	if (catalog_loaded) {
+		e = pv_objects_catalog_get(id);
+		if (e)
+			e->refcount++;
 	}
+	pthread_mutex_unlock(&catalog_lock);
+}
+
+void pv_objects_catalog_remove(const char *id)
+{
+	struct pv_object_entry *e;
+
+	if (!id)
+		return;
+
+	pthread_mutex_lock(&catalog_lock);
+	if (!catalog_loaded)
+		goto out;
+
+	e = pv_objects_catalog_get(id);
+	if (!e)
+		goto out;
 
-	pv_storage_free_subdir(&objects);
+	dl_list_del(&e->list);
+	free(e->id);
+	free(e);
+	catalog_count--;
 out:
-	len += 1;
-	json = realloc(json, len);
-	// close json
-	json[len-2] = ']';
-	json[len-1] = '\0';
+	pthread_mutex_unlock(&catalog_lock);
+}
+
+void pv_objects_catalog_empty(void)
+{
+	struct pv_object_entry *curr, *tmp;
+	int i;
+
+	pthread_mutex_lock(&catalog_lock);
+	if (!catalog_loaded)
+		goto out;
+
+	for (i = 0; i < CATALOG_BUCKETS; i++) {
+		dl_list_for_each_safe(curr, tmp, &catalog[i],
+				struct pv_object_entry, list) {
+			dl_list_del(&curr->list);
+			free(curr->id);
+			free(curr);
+		}
+	}
+
+	catalog_count = 0;
+	catalog_loaded = false;
+out:
+	pthread_mutex_unlock(&catalog_lock);
+}
+
+/*
+ * The json is built with the catalog locked and written after unlocking it,
+ * so a slow ctrl client does not block the updater and the gc
+ */
+int pv_objects_catalog_write_json(int fd)
+{
+	struct pv_object_entry *curr, *tmp;
+	struct pv_json_buf js;
+	int i, ret = -1;
+	bool first = true;
+
+	pthread_mutex_lock(&catalog_lock);
+	pv_objects_catalog_load();
+
+	if (pv_json_buf_init(&js, (catalog_count + 1) * 100))
+		goto unlock;
+
+	if (pv_json_buf_printf(&js, "[") < 0)
+		goto unlock;
+
+	for (i = 0; catalog_loaded && (i < CATALOG_BUCKETS); i++) {
+		dl_list_for_each_safe(curr, tmp, &catalog[i],
+				struct pv_object_entry, list) {
+			if (pv_json_buf_printf(&js,
+				"%s{\"sha256\": \"%s\", \"size\": \"%"PRIu64"\"}",
+				first ? "" : ",", curr->id, (uint64_t) curr->size) < 0)
+				goto unlock;
+			first = false;
+		}
+	}
+
+	if (pv_json_buf_printf(&js, "]") >= 0)
+		ret = 0;
+
+unlock:
+	pthread_mutex_unlock(&catalog_lock);
+
+	if (!ret && (pv_fops_write_nointr(fd, js.buf, js.len) != js.len))
+		ret = -1;
+
+	pv_json_buf_free(&js);
 
-	return json;
+	return ret;
 }
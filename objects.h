@@ -22,10 +22,18 @@
 #ifndef PV_OBJECTS_H
 #define PV_OBJECTS_H
 
-#define OBJPATH_FMT	"%s/objects/%s"
+#define OBJDIR_FMT	"%s/objects"
+#define OBJSHARD_FMT	"%s/objects/%.2s"
+#define OBJPATH_FMT	"%s/objects/%.2s/%s"
+#define OBJPATH_FLAT_FMT	"%s/objects/%s"
+#define OBJLINK_FMT	"%.2s/%s"
+#define OBJMIGRATED_FMT	"%s/objects/.sharded"
 #define RELPATH_FMT	"%s/trails/%s/%s"
 
+#define OBJECTS_MIGRATE_MS	100
+
 #include <stdlib.h>
+#include <time.h>
 
 #include "pantavisor.h"
 
@@ -33,21 +41,42 @@ struct pv_object {
 	char *name;
 	char *id;
 	char *geturl;
+	time_t geturl_expires;
 	char *objpath;
 	char *relpath;
 	off_t size;
 	char *sha256;
+	char *chunks;
 	struct pv_platform *plat;
 	struct dl_list list;
 };
 
+struct pv_object_entry {
+	char *id;
+	off_t size;
+	int refcount;
+	struct dl_list list;
+};
+
 int pv_objects_id_in_step(struct pv_state *s, char *id);
 struct pv_object* pv_objects_add(struct pv_state *s, char *filename, char *id, char *mntpoint);
 void pv_objects_remove(struct pv_object *o);
 struct pv_object* pv_objects_get_by_name(struct pv_state *s, char *name);
 void pv_objects_empty(struct pv_state *s);
 
-char *pv_objects_get_list_string(void);
+char* pv_objects_get_path(const char *id);
+int pv_objects_mkdir(const char *id);
+int pv_objects_link_flat(const char *id);
+int pv_objects_get_ids(struct dl_list *ids);
+int pv_objects_get_leftovers(struct dl_list *paths);
+bool pv_objects_is_migrated(void);
+void pv_objects_migrate(int max_ms);
+
+void pv_objects_catalog_add(const char *id);
+void pv_objects_catalog_link(const char *id);
+void pv_objects_catalog_remove(const char *id);
+void pv_objects_catalog_empty(void);
+int pv_objects_catalog_write_json(int fd);
 
 static inline void pv_object_free(struct pv_object *obj)
 {
@@ -63,6 +92,8 @@ static inline void pv_object_free(struct pv_object *obj)
 		free(obj->relpath);
 	if (obj->sha256)
 		free(obj->sha256);
+	if (obj->chunks)
+		free(obj->chunks);
 
 	free(obj);
 }
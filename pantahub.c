@@ -30,6 +30,7 @@
 #include <limits.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 #include <trest.h>
 #include <thttp.h>
 
@@ -37,6 +38,7 @@
 #include <sys/select.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
 
 #include <netinet/in.h>
 
@@ -50,17 +52,42 @@
 #include "json.h"
 #include "tsh.h"
 #include "metadata.h"
+#include "updater.h"
 
 #define MODULE_NAME             "pantahub-api"
 #define pv_log(level, msg, ...)         vlog(MODULE_NAME, level, msg, ## __VA_ARGS__)
 #include "log.h"
 
 #define ENDPOINT_FMT "/devices/%s"
+#define CERTS_DIR "/certs/"
 
-trest_ptr *client = 0;
-char *endpoint = 0;
+/*
+ * The one trest client the main process talks to pantahub with. The updater
+ * uses it too, so client_lock serializes its requests, its auth and its
+ * replacement, which all happen in this file
+ */
+static trest_ptr *client = 0;
+static char *endpoint = 0;
+static pthread_mutex_t client_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static int ph_client_init(struct pantavisor *pv)
+/*
+ * Cert lists are refcounted, so a reload of the certs dir can free the old
+ * list once the last request or trest client using it is done
+ */
+struct ph_certs {
+	char **files;
+	int refs;
+	struct dl_list list; // ph_certs
+};
+
+static DEFINE_DL_LIST(certs_lists);
+// holds one reference on the list handed out to new users
+static struct ph_certs *certs_current = NULL;
+static int certs_fd = -1;
+static pthread_mutex_t certs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// client_lock must be held
+static int __ph_client_init(struct pantavisor *pv)
 {
 	int size;
 	trest_auth_status_enum status = TREST_AUTH_STATUS_NOTAUTH;
@@ -76,7 +103,9 @@ static int ph_client_init(struct pantavisor *pv)
 auth:
 	status = trest_update_auth(client);
 	if (status != TREST_AUTH_STATUS_OK) {
-		client = NULL; // XXX: free here
+		// the next try logs in with a new client
+		pv_free_trest_client(client);
+		client = NULL;
 		return 0;
 	}
 
@@ -89,6 +118,29 @@ auth:
 	return 1;
 }
 
+static int ph_client_init(struct pantavisor *pv)
+{
+	int ret;
+
+	pthread_mutex_lock(&client_lock);
+	ret = __ph_client_init(pv);
+	pthread_mutex_unlock(&client_lock);
+
+	return ret;
+}
+
+static trest_response_ptr ph_client_do_request(trest_request_ptr req)
+{
+	trest_response_ptr res = NULL;
+
+	pthread_mutex_lock(&client_lock);
+	if (client)
+		res = trest_do_json_request(client, req);
+	pthread_mutex_unlock(&client_lock);
+
+	return res;
+}
+
 static void pv_ph_set_online(struct pantavisor *pv, bool online)
 {
 	int fd, hint;
@@ -117,54 +169,144 @@ static void pv_ph_set_online(struct pantavisor *pv, bool online)
 
 bool pv_ph_is_auth(struct pantavisor *pv)
 {
-	// if client and endpoint exists, it means we have authenticate
-	if (client && endpoint)
-		goto success;
-
-	ph_client_init(pv);
-
-	if (client && endpoint)
-		goto success;
-
-	pv_ph_set_online(pv, false);
-	return false;
+	bool auth;
 
- success:
-	pv_ph_set_online(pv, true);
-	return true;
+	// if client and endpoint exists, it means we have authenticate
+	pthread_mutex_lock(&client_lock);
+	if (!client || !endpoint)
+		__ph_client_init(pv);
+	auth = client && endpoint;
+	pthread_mutex_unlock(&client_lock);
+
+	pv_ph_set_online(pv, auth);
+	return auth;
 }
 
-const char** pv_ph_get_certs(struct pantavisor *__unused)
+static char** pv_ph_scan_certs(void)
 {
 	struct dirent **files;
-	char **cafiles;
-	char *dir = "/certs/";
+	char **list;
 	char path[512];
 	int n = 0, i = 0, size = 0;
 
-	n = scandir(dir, &files, NULL, alphasort);
+	n = scandir(CERTS_DIR, &files, NULL, alphasort);
 	if (n < 0)
 		return NULL;
 
 	// Always n-1 due to . and .., and need one extra
-	cafiles = calloc(1, (sizeof(char*) * (n-1)));
+	list = calloc(1, (sizeof(char*) * (n-1)));
 
 	while (n--) {
-		if (!strncmp(files[n]->d_name, ".", 1))
+		if (!strncmp(files[n]->d_name, ".", 1)) {
+			free(files[n]);
 			continue;
+		}
 
-		sprintf(path, "/certs/%s", files[n]->d_name);
+		sprintf(path, CERTS_DIR "%s", files[n]->d_name);
 		size = strlen(path);
-		cafiles[i] = malloc((size+1) * sizeof(char));
-		memcpy(cafiles[i], path, size);
-		cafiles[i][size] = '\0';
+		list[i] = malloc((size+1) * sizeof(char));
+		memcpy(list[i], path, size);
+		list[i][size] = '\0';
 		i++;
 		free(files[n]);
 	}
 
 	free(files);
 
-	return (const char **) cafiles;
+	return list;
+}
+
+static void pv_ph_free_cert_files(char **files)
+{
+	int i;
+
+	for (i = 0; files[i]; i++)
+		free(files[i]);
+	free(files);
+}
+
+// certs_lock must be held
+static void pv_ph_certs_unref(struct ph_certs *c)
+{
+	if (--c->refs > 0)
+		return;
+
+	dl_list_del(&c->list);
+	pv_ph_free_cert_files(c->files);
+	free(c);
+}
+
+/*
+ * The list is only built again when a file is added to or removed from the
+ * certs dir. Each call takes a reference, dropped with pv_ph_put_certs
+ */
+const char** pv_ph_get_certs(struct pantavisor *__unused)
+{
+	char buf[1024];
+	bool changed = false;
+	struct ph_certs *c;
+	const char **ret = NULL;
+	char **files;
+
+	pthread_mutex_lock(&certs_lock);
+
+	if (certs_fd < 0) {
+		certs_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if ((certs_fd >= 0) && (inotify_add_watch(certs_fd, CERTS_DIR,
+				IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) < 0)) {
+			pv_log(WARN, "cannot watch %s: %s", CERTS_DIR, strerror(errno));
+			close(certs_fd);
+			certs_fd = -1;
+		}
+	}
+
+	while ((certs_fd >= 0) && (read(certs_fd, buf, sizeof(buf)) > 0))
+		changed = true;
+
+	if (!certs_current || changed) {
+		files = pv_ph_scan_certs();
+		c = files ? calloc(1, sizeof(struct ph_certs)) : NULL;
+		if (c) {
+			c->files = files;
+			c->refs = 1;
+			dl_list_init(&c->list);
+			dl_list_add_tail(&certs_lists, &c->list);
+			if (certs_current)
+				pv_ph_certs_unref(certs_current);
+			certs_current = c;
+		} else if (files) {
+			pv_ph_free_cert_files(files);
+		}
+		if (changed)
+			pv_log(INFO, "reloaded cert list from %s", CERTS_DIR);
+	}
+
+	if (certs_current) {
+		certs_current->refs++;
+		ret = (const char **) certs_current->files;
+	}
+
+	pthread_mutex_unlock(&certs_lock);
+
+	return ret;
+}
+
+void pv_ph_put_certs(const char **files)
+{
+	struct ph_certs *c, *tmp;
+
+	if (!files)
+		return;
+
+	pthread_mutex_lock(&certs_lock);
+	dl_list_for_each_safe(c, tmp, &certs_lists,
+			struct ph_certs, list) {
+		if ((const char **) c->files == files) {
+			pv_ph_certs_unref(c);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&certs_lock);
 }
 
 struct pv_connection* pv_get_instance_connection()
@@ -195,10 +337,27 @@ struct pv_connection* pv_get_instance_connection()
 }
 
 
+/*
+ * The updater goes through these two, so the device only logs in once
+ */
+trest_auth_status_enum pv_ph_update_auth(struct pantavisor *pv)
+{
+	return ph_client_init(pv) ? TREST_AUTH_STATUS_OK : TREST_AUTH_STATUS_NOTAUTH;
+}
+
+trest_response_ptr pv_ph_do_request(trest_request_ptr req)
+{
+	return ph_client_do_request(req);
+}
+
 void pv_ph_release_client(struct pantavisor *pv)
 {
+	// the trail endpoints belong to the device of this client
+	pv_trail_remote_remove(pv);
+
+	pthread_mutex_lock(&client_lock);
 	if (client) {
-		trest_free(client);
+		pv_free_trest_client(client);
 		client = 0;
 	}
 
@@ -206,6 +365,7 @@ void pv_ph_release_client(struct pantavisor *pv)
 		free(endpoint);
 		endpoint = 0;
 	}
+	pthread_mutex_unlock(&client_lock);
 }
 
 int pv_ph_device_get_meta(struct pantavisor *pv)
@@ -222,7 +382,7 @@ int pv_ph_device_get_meta(struct pantavisor *pv)
 				 endpoint,
 				 0, 0, 0);
 
-	res = trest_do_json_request(client, req);
+	res = ph_client_do_request(req);
 	if (!res) {
 		pv_log(WARN, "HTTP request GET %s could not be initialized", endpoint);
 	} else if (!res->code &&
@@ -259,7 +419,7 @@ int pv_ph_device_exists(struct pantavisor *pv)
 				 endpoint,
 				 0, 0, 0);
 
-	res = trest_do_json_request(client, req);
+	res = ph_client_do_request(req);
 	if (!res) {
 		pv_log(WARN, "HTTP request GET %s could not be initialized", endpoint);
 	} else if (!res->code &&
@@ -353,6 +513,8 @@ static int pv_ph_register_self_builtin(struct pantavisor *pv)
 		free(req->headers[0]);
 		free(req->headers);
 	}
+	pv_ph_put_certs((const char **) tls_req->crtfiles);
+	tls_req->crtfiles = NULL;
 	if (req)
 		thttp_request_free(req);
 	if (res)
@@ -457,7 +619,7 @@ int pv_ph_device_is_owned(struct pantavisor *pv, char **c)
 				 endpoint,
 				 0, 0, 0);
 
-	res = trest_do_json_request(client, req);
+	res = ph_client_do_request(req);
 	if (!res) {
 		pv_log(WARN, "HTTP request GET %s could not be initialized", endpoint);
 	} else if (!res->code &&
@@ -538,7 +700,7 @@ int pv_ph_upload_metadata(struct pantavisor *pv, char *metadata)
 				 0, 0,
 				 metadata);
 
-	res = trest_do_json_request(client, req);
+	res = ph_client_do_request(req);
 	if (!res) {
 		pv_log(WARN, "PATCH %s could not be initialized", endpoint);
 	} else if (!res->code &&
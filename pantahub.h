@@ -26,6 +26,8 @@
 
 #include <time.h>
 
+#include <trest.h>
+
 #include "pantavisor.h"
 
 struct pv_connection {
@@ -39,7 +41,10 @@ int pv_ph_device_exists(struct pantavisor *pv);
 int pv_ph_register_self(struct pantavisor *pv);
 bool pv_ph_is_auth(struct pantavisor *pv);
 const char** pv_ph_get_certs(struct pantavisor *pv);
+void pv_ph_put_certs(const char **certs);
 int pv_ph_device_is_owned(struct pantavisor *pv, char **c);
+trest_auth_status_enum pv_ph_update_auth(struct pantavisor *pv);
+trest_response_ptr pv_ph_do_request(trest_request_ptr req);
 void pv_ph_release_client(struct pantavisor *pv);
 void pv_ph_update_hint_file(struct pantavisor *pv, char *c);
 int pv_ph_upload_metadata(struct pantavisor *pv, char *metadata);
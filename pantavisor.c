@@ -29,12 +29,17 @@
 #include <ctype.h>
 #include <netdb.h>
 #include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/reboot.h>
 #include <sys/prctl.h>
 #include <sys/resource.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include <linux/limits.h>
 #include <linux/reboot.h>
@@ -54,6 +59,7 @@
 #include "state.h"
 #include "updater.h"
 #include "storage.h"
+#include "objects.h"
 #include "tsh.h"
 #include "metadata.h"
 #include "signature.h"
@@ -80,6 +86,13 @@ static struct timer rollback_timer;
 static struct timer timer_wait_delay;
 static struct timer timer_commit;
 
+// max secs to block in wait when something can only be found by polling
+#define WAIT_POLL_TIMEOUT 2
+// secs between warnings while waiting for network operations to stop
+#define NETWORK_WORKER_STOP_WARN 10
+
+static int wait_epfd = -1;
+
 extern pid_t shell_pid;
 
 typedef enum {
@@ -344,6 +357,31 @@ static int pv_meta_update_to_ph(struct pantavisor *pv)
 	return 0;
 }
 
+/*
+ * network operations run in a worker thread, so latency with the cloud
+ * does not hold the wait loop. Its result is collected by _pv_wait
+ */
+static pthread_t network_thread;
+static bool network_running = false;
+static int network_efd = -1;
+static pv_state_t network_next_state = PV_STATE_WAIT;
+// commands that cannot run along with network operations, in arrival order
+static DEFINE_DL_LIST(network_deferred_cmds);
+// set by the wait loop when it has to leave, checked by the worker
+static pthread_mutex_t network_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool network_stop = false;
+
+static bool pv_network_worker_stopping()
+{
+	bool ret;
+
+	pthread_mutex_lock(&network_lock);
+	ret = network_stop;
+	pthread_mutex_unlock(&network_lock);
+
+	return ret;
+}
+
 static pv_state_t pv_wait_update()
 {
 	struct pantavisor *pv = pv_get_instance();
@@ -402,6 +440,10 @@ static pv_state_t pv_wait_network(struct pantavisor *pv)
 	// start or stop ph logger depending on network and configuration
 	ph_logger_toggle(pv, pv->state->rev);
 
+	// the wait loop can ask us to stop between network operations
+	if (pv_network_worker_stopping())
+		return PV_STATE_WAIT;
+
 	// update meta info
 	if (!pv_metadata_factory_meta_done(pv)) {
 		return PV_STATE_FACTORY_UPLOAD;
@@ -409,6 +451,9 @@ static pv_state_t pv_wait_network(struct pantavisor *pv)
 	if (pv_meta_update_to_ph(pv))
 		goto out;
 
+	if (pv_network_worker_stopping())
+		return PV_STATE_WAIT;
+
 	// check for new remote update
 	if (pv_updater_check_for_updates(pv) > 0) {
 		pv_metadata_add_devmeta(DEVMETA_KEY_PH_STATE, ph_state_string(PH_STATE_UPDATE));
@@ -422,19 +467,236 @@ static pv_state_t pv_wait_network(struct pantavisor *pv)
 	}
 
 out:
+	if (pv_network_worker_stopping())
+		return PV_STATE_WAIT;
+
 	// process ongoing updates, if any
 	return pv_wait_update();
 }
 
-static pv_state_t _pv_wait(struct pantavisor *pv)
+static pv_state_t pv_wait_network_run(struct pantavisor *pv)
 {
 	struct timer t;
 	struct timer_state tstate;
+	pv_state_t next_state;
+
+	timer_start(&t, 5, 0, RELATIV_TIMER);
+	// check if device is unclaimed
+	if (pv->unclaimed) {
+		// unclaimed wait operations
+		next_state = pv_wait_unclaimed(pv);
+	} else {
+		// rest of network wait stuff: connectivity check. update management,
+		// meta data uppload, ph logger push start...
+		next_state = pv_wait_network(pv);
+	}
+	tstate = timer_current_state(&t);
+	if (tstate.fin) {
+		pv_log(DEBUG, "network operations took %d seconds!",  5 + tstate.sec);
+	}
+
+	return next_state;
+}
+
+static void* pv_network_worker(void *arg)
+{
+	uint64_t done = 1;
+
+	network_next_state = pv_wait_network_run((struct pantavisor*) arg);
+
+	// wake up the wait loop
+	if (write(network_efd, &done, sizeof(done)) < 0)
+		pv_log(WARN, "could not notify network worker end: %s", strerror(errno));
+
+	return NULL;
+}
+
+static pv_state_t pv_network_worker_start(struct pantavisor *pv)
+{
+	if (network_efd < 0)
+		return pv_wait_network_run(pv);
+
+	network_next_state = PV_STATE_WAIT;
+	network_stop = false;
+	if (pthread_create(&network_thread, NULL, pv_network_worker, pv)) {
+		pv_log(WARN, "could not start network worker, running in place");
+		return pv_wait_network_run(pv);
+	}
+	network_running = true;
+
+	return PV_STATE_WAIT;
+}
+
+static bool pv_network_worker_done()
+{
+	uint64_t done;
+
+	return network_running &&
+		(read(network_efd, &done, sizeof(done)) == sizeof(done));
+}
+
+static pv_state_t pv_network_worker_join()
+{
+	uint64_t done;
+
+	if (!network_running)
+		return PV_STATE_WAIT;
+
+	pthread_join(network_thread, NULL);
+	network_running = false;
+	// reset the notification in case it was not consumed yet
+	if (read(network_efd, &done, sizeof(done)) < 0 && errno != EAGAIN)
+		pv_log(WARN, "could not read network worker end: %s", strerror(errno));
+
+	return network_next_state;
+}
+
+/*
+ * Asks the network worker to stop after the operation in course and waits
+ * for it, kicking the watchdog meanwhile. Requests in course end with the
+ * network timeouts, so the worker is never left running behind us
+ */
+static void pv_network_worker_stop(struct pantavisor *pv)
+{
+	struct pollfd pfd;
+	int secs = 0;
+
+	if (!network_running)
+		return;
+
+	pthread_mutex_lock(&network_lock);
+	network_stop = true;
+	pthread_mutex_unlock(&network_lock);
+
+	pfd.fd = network_efd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, 1000) <= 0) {
+		pv_wdt_kick(pv);
+		if (!(++secs % NETWORK_WORKER_STOP_WARN))
+			pv_log(WARN, "still waiting for network operations to stop after %d seconds",
+				secs);
+	}
+
+	pv_network_worker_join();
+}
+
+static void pv_wait_timeout_min(int *timeout, struct timer *t)
+{
+	struct timer_state tstate = timer_current_state(t);
+	int ms;
+
+	if (tstate.fin) {
+		*timeout = 0;
+		return;
+	}
+
+	ms = tstate.sec * 1000 + tstate.nsec / 1000000 + 1;
+	if (ms < *timeout)
+		*timeout = ms;
+}
+
+/*
+ * msecs until something in the wait state is due. Ctrl requests and
+ * platform exits wake us up before that
+ */
+static int pv_wait_get_timeout(struct pantavisor *pv, bool polling)
+{
+	int timeout = pv_config_get_updater_interval() * 1000;
+
+	if (polling || (timeout <= 0) || !pv_objects_is_migrated())
+		timeout = WAIT_POLL_TIMEOUT * 1000;
+
+	if (pv_config_get_watchdog_enabled() &&
+		(pv_config_get_watchdog_timeout() > 0) &&
+		(pv_config_get_watchdog_timeout() * 500 < timeout))
+		timeout = pv_config_get_watchdog_timeout() * 500;
+
+	if (pv->remote_mode)
+		pv_wait_timeout_min(&timeout, &timer_wait_delay);
+	// the network worker owns the update until it is done
+	if (!network_running && pv_update_is_testing(pv->update))
+		pv_wait_timeout_min(&timeout, &timer_commit);
+
+	return timeout;
+}
+
+static int pv_wait_event_init(struct pantavisor *pv)
+{
+	struct epoll_event ev;
+
+	if (wait_epfd >= 0)
+		return 0;
+
+	wait_epfd = epoll_create1(EPOLL_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.fd = pv->ctrl_fd;
+	if ((wait_epfd >= 0) &&
+		epoll_ctl(wait_epfd, EPOLL_CTL_ADD, pv->ctrl_fd, &ev)) {
+		close(wait_epfd);
+		wait_epfd = -1;
+	}
+	if (wait_epfd < 0) {
+		pv_log(WARN, "could not set up event loop: %s", strerror(errno));
+		return -1;
+	}
+
+	// without this, network operations block the wait loop
+	network_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ev.events = EPOLLIN;
+	ev.data.fd = network_efd;
+	if ((network_efd >= 0) &&
+		epoll_ctl(wait_epfd, EPOLL_CTL_ADD, network_efd, &ev)) {
+		close(network_efd);
+		network_efd = -1;
+	}
+	if (network_efd < 0)
+		pv_log(WARN, "could not set up network worker: %s", strerror(errno));
+
+	return 0;
+}
+
+static struct pv_cmd* pv_wait_event(struct pantavisor *pv)
+{
+	struct epoll_event ev[8];
+	struct pv_cmd *cmd = NULL;
+	bool polling;
+	int n, i;
+
+	if (wait_epfd < 0)
+		return pv_ctrl_socket_wait(pv->ctrl_fd, WAIT_POLL_TIMEOUT);
+
+	// without pidfds, platform exits can only be found by polling
+	polling = pv_platforms_watch_exited(pv, wait_epfd) < 0;
+
+	n = epoll_wait(wait_epfd, ev, sizeof(ev) / sizeof(ev[0]),
+		pv_wait_get_timeout(pv, polling));
+	if ((n < 0) && (errno != EINTR))
+		pv_log(WARN, "could not wait for events: %s", strerror(errno));
+
+	for (i = 0; i < n; i++) {
+		// network worker result is collected in the next wait
+		if (ev[i].data.fd == network_efd)
+			continue;
+		else if (ev[i].data.fd != pv->ctrl_fd)
+			pv_platforms_unwatch(pv, ev[i].data.fd);
+		// one command per wait, the rest stay queued in the socket
+		else if (!cmd)
+			cmd = pv_ctrl_socket_accept(pv->ctrl_fd);
+	}
+
+	return cmd;
+}
+
+static pv_state_t _pv_wait(struct pantavisor *pv)
+{
 	pv_state_t next_state = PV_STATE_WAIT;
 
+	pv_wait_event_init(pv);
+
 	// check if any platform has exited and we need to tear down
 	if (pv_platforms_check_exited(pv, 0)) {
 		pv_log(ERROR, "one or more platforms exited. Tearing down...");
+		pv_network_worker_stop(pv);
 		if (pv_update_is_trying(pv->update) || pv_update_is_testing(pv->update))
 			next_state = PV_STATE_ROLLBACK;
 		else
@@ -442,50 +704,64 @@ static pv_state_t _pv_wait(struct pantavisor *pv)
 		goto out;
 	}
 
+	if (pv_network_worker_done())
+		next_state = pv_network_worker_join();
+
+	// commands that had to wait for network operations to finish, one per wait
+	if ((next_state == PV_STATE_WAIT) && !network_running &&
+		!dl_list_empty(&network_deferred_cmds)) {
+		pv->cmd = dl_list_first(&network_deferred_cmds, struct pv_cmd, list);
+		dl_list_del(&pv->cmd->list);
+		next_state = PV_STATE_COMMAND;
+		goto out;
+	}
+
+	if ((next_state != PV_STATE_WAIT) || network_running)
+		goto wait;
+
 	// we only get into network operations if remote mode is set to 1 in config (can be unset if revision is "locals/...")
 	// also, in case device is unclaimed, the current update must finish first (this is specially done for rev 0 that comes from command make-factory)
 	if (pv->remote_mode &&
 		(!pv->unclaimed ||
 		(pv->unclaimed && !pv->update))) {
-		timer_start(&t, 5, 0, RELATIV_TIMER);
 		// with this wait, we make sure we have not consecutively executed network stuff
 		// twice in less than the configured interval
-		if (pv_wait_delay_timedout(pv_config_get_updater_interval())) {
-			// check if device is unclaimed
-			if (pv->unclaimed) {
-				// unclaimed wait operations
-				next_state = pv_wait_unclaimed(pv);
-			} else {
-				// rest of network wait stuff: connectivity check. update management,
-				// meta data uppload, ph logger push start...
-				next_state = pv_wait_network(pv);
-			}
-		}
-		tstate = timer_current_state(&t);
-		if (tstate.fin) {
-			pv_log(DEBUG, "network operations are taking %d seconds!",  5 + tstate.sec);
-		}
+		if (pv_wait_delay_timedout(pv_config_get_updater_interval()))
+			next_state = pv_network_worker_start(pv);
 	} else {
 		// process ongoing updates, if any
 		next_state = pv_wait_update();
 	}
 
+wait:
 	if (next_state != PV_STATE_WAIT)
 		goto out;
 
 	// update network info in devmeta
 	pv_network_update_meta(pv);
 
-	// check if we need to run garbage collector
-	pv_storage_gc_run_threshold();
+	// storage and update are left alone while network operations run
+	if (!network_running) {
+		// check if we need to run garbage collector
+		pv_storage_gc_run_threshold();
+
+		// move some objects to the sharded layout. Object paths of an ongoing
+		// update were resolved when parsing its state, so wait for it to end
+		if (!pv->update && !pv->loading_objects)
+			pv_objects_migrate(OBJECTS_MIGRATE_MS);
+	}
 
-	// receive new command. Set 2 secs as the select max blocking time, so we can do the
-	// rest of WAIT operations
-	pv->cmd = pv_ctrl_socket_wait(pv->ctrl_fd, 2);
+	// block until a command comes, a platform exits or a timer is due
+	pv->cmd = pv_wait_event(pv);
 	if (pv->cmd)
 		next_state = PV_STATE_COMMAND;
 
 out:
+	// commands are sorted out in _pv_command, other states cannot run along
+	// with network operations
+	if ((next_state != PV_STATE_WAIT) && (next_state != PV_STATE_COMMAND))
+		pv_network_worker_stop(pv);
+
 	return next_state;
 }
 
@@ -498,6 +774,17 @@ static pv_state_t _pv_command(struct pantavisor *pv)
 	if (!cmd)
 		return PV_STATE_WAIT;
 
+	// metadata is safe to parse along with network operations. The rest of
+	// commands can change the update or the storage, so they wait for them
+	if (network_running && (cmd->op != CMD_UPDATE_METADATA)) {
+		pv_log(DEBUG, "%s command waiting for network operations to finish",
+			pv_ctrl_string_cmd_operation(cmd->op));
+		dl_list_init(&cmd->list);
+		dl_list_add_tail(&network_deferred_cmds, &cmd->list);
+		pv->cmd = NULL;
+		return PV_STATE_WAIT;
+	}
+
 	switch (cmd->op) {
 	case CMD_UPDATE_METADATA:
 		if (pv->remote_mode) {
@@ -754,6 +1041,7 @@ static void pv_remove(struct pantavisor *pv)
 	pv_trail_remote_remove(pv);
 	pv_config_free();
 	pv_metadata_remove();
+	pv_objects_catalog_empty();
 
 	free(pv);
 	pv = NULL;
@@ -762,9 +1050,21 @@ static void pv_remove(struct pantavisor *pv)
 void pv_stop()
 {
 	struct pantavisor *pv = pv_get_instance();
+	struct pv_cmd *cmd, *tmp;
+
 	if (!pv)
 		return;
 
+	pv_network_worker_stop(pv);
+	dl_list_for_each_safe(cmd, tmp, &network_deferred_cmds,
+			struct pv_cmd, list) {
+		dl_list_del(&cmd->list);
+		pv_ctrl_free_cmd(cmd);
+	}
+	if (network_efd >= 0)
+		close(network_efd);
+	if (wait_epfd >= 0)
+		close(wait_epfd);
 	pv_ctrl_socket_close(pv->ctrl_fd);
 
 	pv_bootloader_remove();
@@ -52,6 +52,7 @@
 #include "str.h"
 #include "json.h"
 #include "fops.h"
+#include "ratelimit.h"
 #include "ph_logger.h"
 #include "ph_logger_v1.h"
 
@@ -157,6 +158,8 @@ struct ph_logger {
 	pid_t log_service;
 	pid_t range_service;
 	pid_t push_service;
+	int push_service_ratelimit; // limit the running push service was started with
+	struct ratelimit push_ratelimit;
 };
 
 static struct ph_logger ph_logger = {
@@ -166,7 +169,8 @@ static struct ph_logger ph_logger = {
 	.client = NULL,
 	.log_service = -1,
 	.range_service = -1,
-	.push_service = -1
+	.push_service = -1,
+	.push_ratelimit = RATELIMIT_INIT
 };
 
 static ph_logger_handler_t read_handler[] = {
@@ -334,7 +338,7 @@ static int ph_logger_get_connection(struct ph_logger *ph_logger)
 
 	ph_logger->pv_conn = pv_get_instance_connection();
 	if (ph_logger->client) {
-		trest_free(ph_logger->client);
+		pv_free_trest_client(ph_logger->client);
 		ph_logger->client = NULL;
 	}
 out:
@@ -425,6 +429,12 @@ static int ph_logger_push_logs_endpoint(struct ph_logger *ph_logger, char *logs)
 	if (ph_logger->client)
 		goto auth;
 
+	// each push service process has its own bucket
+	if (ratelimit_set(&ph_logger->push_ratelimit, pv_config_get_log_push_ratelimit(),
+		pv_config_get_log_push_ratelimit_window()))
+		ph_log(WARN, "bad log push rate limit window '%s', limiting all day",
+			pv_config_get_log_push_ratelimit_window());
+
 	ph_logger->client = pv_get_trest_client(pv_global, ph_logger->pv_conn);
 
 	if (!ph_logger->client) {
@@ -442,6 +452,8 @@ auth:
 	if (!req) {
 		goto out;
 	}
+	// the request goes at link speed, but the pushes that follow wait for it
+	ratelimit_consume(&ph_logger->push_ratelimit, strlen(logs));
 	res = trest_do_json_request(ph_logger->client, req);
 	if (!res) {
 		ph_log(WARN, "HTTP request POST /logs/ could not be initialized");
@@ -1089,6 +1101,7 @@ static void ph_logger_start_cloud(struct pantavisor *pv, char *revision)
 		return;
 
 	if (ph_logger.push_service == -1) {
+		ph_logger.push_service_ratelimit = pv_config_get_log_push_ratelimit();
 		ph_logger.push_service = ph_logger_start_push_service(revision);
 		if (ph_logger.push_service > 0) {
 			pv_log(DEBUG, "started push service with pid %d", ph_logger.push_service);
@@ -1159,6 +1172,15 @@ void ph_logger_toggle(struct pantavisor *pv, char *rev)
 	else
 		ph_logger_stop_local(pv);
 
+	// the push service reads its limit when it starts, restart it to apply a new one
+	if ((ph_logger.push_service > 0) &&
+		(ph_logger.push_service_ratelimit != pv_config_get_log_push_ratelimit())) {
+		kill_child_process(ph_logger.push_service);
+		pv_log(DEBUG, "stopped push service with pid %d to change its rate limit",
+			ph_logger.push_service);
+		ph_logger.push_service = -1;
+	}
+
 	if (pv_config_get_log_push() &&
 		pv_get_instance()->remote_mode)
 		ph_logger_start_cloud(pv, rev);
@@ -31,6 +31,8 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 
 #include <linux/limits.h>
 
@@ -103,6 +105,7 @@ struct pv_platform* pv_platform_add(struct pv_state *s, char *name)
 
 	if (p) {
 		p->name = strdup(name);
+		p->pidfd = -1;
 		p->status = PLAT_NONE;
 		p->runlevel = -1;
 		p->updated = false;
@@ -188,6 +191,9 @@ void pv_platform_free(struct pv_platform *p)
 	pv_platform_empty_logger_list(p);
 	pv_platform_empty_logger_configs(p);
 
+	if (p->pidfd >= 0)
+		close(p->pidfd);
+
 	free(p);
 }
 
@@ -744,6 +750,86 @@ int pv_platforms_check_exited(struct pantavisor *pv, int runlevel)
 	return exited;
 }
 
+static int pv_platform_pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * Adds the init process of every started platform to epfd. Returns -1 if
+ * any of them could not be added, so the caller has to keep polling
+ */
+int pv_platforms_watch_exited(struct pantavisor *pv, int epfd)
+{
+	struct pv_platform *p, *tmp;
+	struct dl_list *platforms = NULL;
+	struct epoll_event ev;
+	int ret = 0;
+
+	if (!pv->state)
+		return 0;
+
+	platforms = &pv->state->platforms;
+	dl_list_for_each_safe(p, tmp, platforms,
+			struct pv_platform, list) {
+		if (p->init_pid <= 0)
+			continue;
+
+		// already watched, or already exited
+		if (p->pidfd_pid == p->init_pid)
+			continue;
+
+		if (p->pidfd >= 0)
+			close(p->pidfd);
+
+		p->pidfd = pv_platform_pidfd_open(p->init_pid);
+		if (p->pidfd < 0) {
+			ret = -1;
+			continue;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.fd = p->pidfd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, p->pidfd, &ev)) {
+			close(p->pidfd);
+			p->pidfd = -1;
+			ret = -1;
+			continue;
+		}
+		p->pidfd_pid = p->init_pid;
+	}
+
+	return ret;
+}
+
+/*
+ * fd stays readable once the process is gone, so it is only reported once
+ */
+void pv_platforms_unwatch(struct pantavisor *pv, int fd)
+{
+	struct pv_platform *p, *tmp;
+	struct dl_list *platforms = NULL;
+
+	if (!pv->state)
+		return;
+
+	platforms = &pv->state->platforms;
+	dl_list_for_each_safe(p, tmp, platforms,
+			struct pv_platform, list) {
+		if (p->pidfd != fd)
+			continue;
+
+		pv_log(DEBUG, "platform %s init process exited", p->name);
+		close(p->pidfd);
+		p->pidfd = -1;
+	}
+}
+
 static int pv_platforms_early_init(struct pv_init *this)
 {
 	struct pantavisor *pv = NULL;
@@ -46,6 +46,9 @@ struct pv_platform {
 	unsigned long ns_share;
 	void *data;
 	pid_t init_pid;
+	// wakes up the main loop when init_pid exits
+	int pidfd;
+	pid_t pidfd_pid;
 	plat_status_t status;
 	int runlevel;
 	bool mgmt;
@@ -71,6 +74,8 @@ void pv_platforms_add_all_loggers(struct pv_state *s);
 
 int pv_platforms_start(struct pantavisor *pv, int runlevel);
 int pv_platforms_check_exited(struct pantavisor *pv, int runlevel);
+int pv_platforms_watch_exited(struct pantavisor *pv, int epfd);
+void pv_platforms_unwatch(struct pantavisor *pv, int fd);
 int pv_platforms_stop(struct pantavisor *pv, int runlevel);
 void pv_platforms_empty(struct pv_state *s);
 
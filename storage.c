@@ -44,6 +44,7 @@
 
 #include "updater.h"
 #include "objects.h"
+#include "chunks.h"
 #include "storage.h"
 #include "state.h"
 #include "bootloader.h"
@@ -65,46 +66,79 @@ static struct timer threshold_timer;
 
 static int pv_storage_gc_objects(struct pantavisor *pv)
 {
-	int reclaimed = 0, len;
-	char path[PATH_MAX];
+	int reclaimed = 0, removed = 0;
+	char *path, *id, tmp_id[65];
 	struct stat st;
 	struct pv_path *o, *tmp;
 	struct dl_list objects;
 
 	dl_list_init(&objects);
 
-	len = strlen("%s/objects/") + strlen(pv_config_get_storage_mntpoint()) + 1;
-	snprintf(path, len, "%s/objects/", pv_config_get_storage_mntpoint());
-	if (pv_storage_get_subdir(path, "", &objects))
+	if (pv_objects_get_ids(&objects))
 		goto out;
 
 	dl_list_for_each_safe(o, tmp, &objects, struct pv_path, list) {
 		pv_log(DEBUG, "path %s", o->path);
-		if (!strncmp(o->path, "..", len) ||
-			!strncmp(o->path, ".", len))
+
+		path = pv_objects_get_path(o->path);
+		if (!path)
 			continue;
 
-		len = strlen("%s/objects") + strlen(pv_config_get_storage_mntpoint()) + strlen(o->path) +1;
-		snprintf(path, len, "%s/objects/%s", pv_config_get_storage_mntpoint(), o->path);
 		memset(&st, 0, sizeof(struct stat));
 		if (stat(path, &st) < 0)
-			continue;
+			goto next;
 
-		if (st.st_nlink > 1)
-			continue;
+		if (st.st_nlink > 1) {
+			// revisions might have been removed since last scan
+			pv_objects_catalog_add(o->path);
+			goto next;
+		}
 
 		// do not remove objects belonging to an ongoing update
 		if (pv->update) {
 			if (pv_objects_id_in_step(pv->update->pending, o->path))
-				continue;
+				goto next;
 		}
 
 		// remove,unlink object and sync fs
 		reclaimed += st.st_size;
 		remove(path);
 		sync();
+		pv_objects_catalog_remove(o->path);
+		pv_chunks_remove_object(o->path);
 		pv_log(DEBUG, "removed unused object '%s', reclaimed %lu bytes", path, st.st_size);
+next:
+		free(path);
+	}
+
+	// tmp files of interrupted or abandoned downloads and chunk indexes
+	pv_storage_free_subdir(&objects);
+	if (pv_objects_get_leftovers(&objects) ||
+		pv_chunks_get_leftovers(&objects))
+		goto out;
+
+	dl_list_for_each_safe(o, tmp, &objects, struct pv_path, list) {
+		// resumable downloads of an ongoing update start with the object id
+		id = strrchr(o->path, '/');
+		id = id ? id + 1 : o->path;
+		if (pv->update && pv->update->pending) {
+			strncpy(tmp_id, id, sizeof(tmp_id) - 1);
+			tmp_id[sizeof(tmp_id) - 1] = '\0';
+			if (pv_objects_id_in_step(pv->update->pending, tmp_id))
+				continue;
+		}
+
+		memset(&st, 0, sizeof(struct stat));
+		if (lstat(o->path, &st) < 0)
+			continue;
+
+		reclaimed += st.st_size;
+		remove(o->path);
+		removed++;
+		pv_log(DEBUG, "removed leftover '%s', reclaimed %lu bytes", o->path, st.st_size);
 	}
+	if (removed)
+		syncfs_path(pv_config_get_storage_mntpoint());
 
 out:
 	pv_storage_free_subdir(&objects);
@@ -430,18 +464,18 @@ out:
 
 bool pv_storage_validate_objects_object_checksum(char *checksum)
 {
-	int len;
-	char path[PATH_MAX];
+	bool ret;
+	char *path;
 
-	len = strlen("%s/objects/%s") +
-		strlen(pv_config_get_storage_mntpoint()) +
-		strlen(checksum);
-	snprintf(path, len, "%s/objects/%s",
-		 pv_config_get_storage_mntpoint(),
-		 checksum);
+	path = pv_objects_get_path(checksum);
+	if (!path)
+		return false;
 
 	pv_log(DEBUG, "validating checksum for object %s", path);
-	return !pv_storage_validate_file_checksum(path, checksum);
+	ret = !pv_storage_validate_file_checksum(path, checksum);
+	free(path);
+
+	return ret;
 }
 
 
@@ -552,7 +586,7 @@ int pv_storage_update_factory(const char* rev)
 		goto out;
 	}
 
-	if (pv_fops_copy_and_close(fd_c, fd_f) < 0) {
+	if (pv_fops_copy(fd_c, fd_f) < 0) {
 		pv_log(ERROR, "cannot copy %s into %s: %s", revision, factory, strerror(errno));
 		goto out;
 	}
@@ -802,6 +836,7 @@ void pv_storage_meta_set_objdir(struct pantavisor *pv)
 	if (fd < 0)
 		goto err;
 
+	// objects/ keeps a flat link to each sharded object for pvr
 	sprintf(path, "{\"ObjectsDir\": \"%s/objects\"}", pv_config_get_storage_mntpoint());
 	/*
 	 * [PKS]
@@ -874,7 +909,7 @@ int pv_storage_meta_expand_jsons(struct pantavisor *pv, struct pv_state *s)
 			mkdir_p(dir, 0755);
 		free(file);
 
-		fd = open(path, O_CREAT | O_SYNC | O_WRONLY, 0644);
+		fd = open(path, O_CREAT | O_WRONLY, 0644);
 		if (fd < 0)
 			goto out;
 
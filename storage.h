@@ -22,8 +22,7 @@
 #ifndef PV_STORAGE_H
 #define PV_STORAGE_H
 
-#define PATH_OBJECTS_TMP "%s/objects/%s.new"
-#define PATH_OBJECTS "%s/objects/%s"
+#define PATH_OBJECTS_TMP "%s.new"
 #define PATH_TRAILS_PVR_PARENT "%s/trails/%s/.pvr"
 #define PATH_TRAILS_PV_PARENT "%s/trails/%s/.pv"
 #define PATH_TRAILS "%s/trails/%s/.pvr/json"
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2021 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include "log.h"
+#include "tsh.h"
+
+/*
+ * The modules under test log through pv_log and some of them can run
+ * commands. The tests run on the host, without the rest of pantavisor
+ */
+
+void __log(char *module, int level, const char *fmt, ...)
+{
+}
+
+void pv_log_put_buffer(struct log_buffer *log_buf)
+{
+}
+
+pid_t tsh_run_io(char *cmd, int wait, int *status,
+	int stdin_p[], int stdout_p[], int stderr_p[])
+{
+	return -1;
+}
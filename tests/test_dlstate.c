@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2021 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dlstate.h"
+#include "fops.h"
+#include "test.h"
+
+#define ID_A "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"
+#define ID_B "fedcba9876543210fedcba9876543210fedcba9876543210fedcba9876543210"
+
+static char path[] = "/tmp/pv-test-dlstate.XXXXXX";
+
+static void write_raw(const void *buf, size_t len)
+{
+	int fd;
+
+	fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	check(fd >= 0);
+	check(pv_fops_write_nointr(fd, (char *) buf, len) == (ssize_t) len);
+	close(fd);
+}
+
+static void test_round_trip(void)
+{
+	uint64_t offset = 0;
+	char path_tmp[sizeof(path) + 4];
+	struct stat st;
+
+	check(!dlstate_save(path, ID_A, 4 * 1024 * 1024 + 3));
+	check(!dlstate_load(path, ID_A, &offset));
+	check(offset == 4 * 1024 * 1024 + 3);
+
+	// saving again replaces the state and leaves nothing behind
+	check(!dlstate_save(path, ID_A, 1ULL << 33));
+	check(!dlstate_load(path, ID_A, &offset));
+	check(offset == 1ULL << 33);
+	snprintf(path_tmp, sizeof(path_tmp), "%s.new", path);
+	check(stat(path_tmp, &st) && (errno == ENOENT));
+
+	// the state of another object is not ours
+	offset = 7;
+	check(dlstate_load(path, ID_B, &offset) == -1);
+	check(offset == 7);
+}
+
+static void test_bad_files(void)
+{
+	uint64_t offset = 7;
+	struct dlstate state;
+	char buf[sizeof(state) + 1];
+
+	memset(&state, 0, sizeof(state));
+	state.magic = DLSTATE_MAGIC;
+	state.version = DLSTATE_VERSION;
+	state.size = sizeof(state);
+	strcpy(state.id, ID_A);
+	state.offset = 10;
+
+	write_raw(&state, sizeof(state));
+	check(!dlstate_load(path, ID_A, &offset));
+	check(offset == 10);
+	offset = 7;
+
+	// truncated
+	write_raw(&state, sizeof(state) - 1);
+	check(dlstate_load(path, ID_A, &offset) == -1);
+
+	// longer than a state
+	memcpy(buf, &state, sizeof(state));
+	buf[sizeof(state)] = 'x';
+	write_raw(buf, sizeof(buf));
+	check(dlstate_load(path, ID_A, &offset) == -1);
+
+	state.magic++;
+	write_raw(&state, sizeof(state));
+	check(dlstate_load(path, ID_A, &offset) == -1);
+	state.magic--;
+
+	state.version++;
+	write_raw(&state, sizeof(state));
+	check(dlstate_load(path, ID_A, &offset) == -1);
+	state.version--;
+
+	state.size--;
+	write_raw(&state, sizeof(state));
+	check(dlstate_load(path, ID_A, &offset) == -1);
+
+	remove(path);
+	check(dlstate_load(path, ID_A, &offset) == -1);
+	check(offset == 7);
+}
+
+int main(void)
+{
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return EXIT_FAILURE;
+	close(fd);
+
+	test_round_trip();
+	test_bad_files();
+
+	remove(path);
+
+	return test_done();
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2021 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fops.h"
+#include "test.h"
+
+#define SRC_SIZE (300 * 1024 + 17)
+
+static char src_buf[SRC_SIZE];
+
+static int tmp_file(char *path, const char *buf, size_t len)
+{
+	int fd;
+
+	strcpy(path, "/tmp/pv-test-fops.XXXXXX");
+	fd = mkstemp(path);
+	if (fd < 0)
+		return -1;
+
+	if (len && (pv_fops_write_nointr(fd, (char *) buf, len) != (ssize_t) len)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static bool same_content(int fd, const char *buf, size_t len)
+{
+	struct stat st;
+	char *content;
+	bool ret;
+
+	if (fstat(fd, &st) || ((size_t) st.st_size != len))
+		return false;
+
+	content = malloc(len + 1);
+	if (!content)
+		return false;
+
+	ret = (pread(fd, content, len, 0) == (ssize_t) len) &&
+		!memcmp(content, buf, len);
+	free(content);
+
+	return ret;
+}
+
+// copies src into a destination opened with flags, which can hold old data
+static void test_copy(int src, int flags, const char *old, size_t old_len)
+{
+	char path[32];
+	int dst;
+
+	dst = tmp_file(path, old, old_len);
+	check(dst >= 0);
+	close(dst);
+
+	dst = open(path, O_RDWR | flags);
+	check(dst >= 0);
+
+	check(pv_fops_copy(src, dst) == SRC_SIZE);
+	check(same_content(dst, src_buf, SRC_SIZE));
+
+	close(dst);
+	unlink(path);
+}
+
+static void test_copy_empty(void)
+{
+	char src_path[32], dst_path[32];
+	int src, dst;
+
+	src = tmp_file(src_path, NULL, 0);
+	dst = tmp_file(dst_path, "stale", 5);
+	check((src >= 0) && (dst >= 0));
+
+	check(pv_fops_copy(src, dst) == 0);
+	check(same_content(dst, "", 0));
+
+	close(src);
+	close(dst);
+	unlink(src_path);
+	unlink(dst_path);
+}
+
+static void test_copy_and_close(int src)
+{
+	char path[32];
+	int fd, dst;
+
+	// pv_fops_copy_and_close closes the source, so give it its own fd
+	fd = dup(src);
+	dst = tmp_file(path, NULL, 0);
+	check((fd >= 0) && (dst >= 0));
+
+	check(pv_fops_copy_and_close(fd, dst) == 0);
+	check(fcntl(fd, F_GETFD) < 0);
+	check(same_content(dst, src_buf, SRC_SIZE));
+
+	close(dst);
+	unlink(path);
+}
+
+int main(void)
+{
+	char path[32];
+	char *old;
+	size_t i;
+	int src;
+
+	for (i = 0; i < SRC_SIZE; i++)
+		src_buf[i] = (i * 31 + i / 4096) & 0xff;
+
+	src = tmp_file(path, src_buf, SRC_SIZE);
+	check(src >= 0);
+
+	// empty destination, reflink or copy_file_range
+	test_copy(src, 0, NULL, 0);
+
+	// longer destination must not keep its tail
+	old = malloc(2 * SRC_SIZE);
+	check(old != NULL);
+	memset(old, 'x', 2 * SRC_SIZE);
+	test_copy(src, 0, old, 2 * SRC_SIZE);
+	free(old);
+
+	// copy_file_range and sendfile refuse O_APPEND, so this is the read loop
+	test_copy(src, O_APPEND, "stale", 5);
+
+	test_copy_empty();
+	test_copy_and_close(src);
+
+	close(src);
+	unlink(path);
+
+	return test_done();
+}
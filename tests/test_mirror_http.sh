@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Serves two objects with scripts/pv_mirror and fetches them the way the
+# updater does: by sha256 under the base url, with a 4xx for missing ones
+
+tmp=$(mktemp -d)
+port=$((20000 + $$ % 20000))
+url="http://127.0.0.1:$port"
+server=
+fail=0
+
+cleanup() {
+	[ -n "$server" ] && kill "$server" 2>/dev/null
+	rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+check() {
+	if ! "$@"; then
+		echo "$0: check failed: $*" >&2
+		fail=1
+	fi
+}
+
+mkdir -p "$tmp/objects/sub"
+echo "first object" > "$tmp/objects/a"
+head -c 300000 /dev/urandom > "$tmp/objects/sub/b"
+
+../scripts/pv_mirror "$tmp/objects" "$tmp/mirror" "$port" >/dev/null 2>&1 &
+server=$!
+
+i=0
+while ! curl -s -o /dev/null "$url/" && [ $i -lt 50 ]; do
+	sleep 0.1
+	i=$((i + 1))
+done
+
+for f in "$tmp/objects/a" "$tmp/objects/sub/b"; do
+	sha=$(sha256sum "$f" | cut -d' ' -f1)
+	check curl -sf -o "$tmp/out" "$url/$sha"
+	check test "$(sha256sum "$tmp/out" | cut -d' ' -f1)" = "$sha"
+done
+
+code=$(curl -s -o /dev/null -w '%{http_code}' "$url/$(printf missing | sha256sum | cut -d' ' -f1)")
+check test "$code" -ge 400 -a "$code" -lt 500
+
+if [ $fail -ne 0 ]; then
+	echo "$0: FAIL" >&2
+	exit 1
+fi
+echo "$0: ok" >&2
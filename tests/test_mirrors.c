@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2021 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "mirrors.h"
+#include "test.h"
+
+static int count_mirrors(void)
+{
+	struct pv_mirror *m, *tmp;
+	int n = 0;
+
+	dl_list_for_each_safe(m, tmp, pv_mirrors_get(),
+			struct pv_mirror, list)
+		n++;
+
+	return n;
+}
+
+static struct pv_mirror* nth_mirror(int i)
+{
+	struct pv_mirror *m, *tmp;
+
+	dl_list_for_each_safe(m, tmp, pv_mirrors_get(),
+			struct pv_mirror, list) {
+		if (!i--)
+			return m;
+	}
+
+	return NULL;
+}
+
+static void test_load(void)
+{
+	const char *config = "http://a.local/ ,file:///srv/objects ftp://b.local https://c.local//";
+
+	pv_mirrors_load(NULL);
+	check(count_mirrors() == 0);
+
+	// in order, without trailing slashes and without unsupported urls
+	pv_mirrors_load(config);
+	check(count_mirrors() == 3);
+	check(!strcmp(nth_mirror(0)->url, "http://a.local"));
+	check(!strcmp(nth_mirror(1)->url, "file:///srv/objects"));
+	check(!strcmp(nth_mirror(2)->url, "https://c.local"));
+
+	// health is kept while the list does not change
+	pv_mirror_set_result(nth_mirror(0), false);
+	pv_mirrors_load(config);
+	check(nth_mirror(0)->failures == 1);
+
+	pv_mirrors_load("http://a.local");
+	check(count_mirrors() == 1);
+	check(nth_mirror(0)->failures == 0);
+
+	pv_mirrors_load(NULL);
+	check(count_mirrors() == 0);
+}
+
+static void test_backoff(void)
+{
+	struct pv_mirror *m;
+	int i, secs = MIRROR_RETRY_MIN;
+
+	pv_mirrors_load("http://a.local");
+	m = nth_mirror(0);
+	check(m != NULL);
+	if (!m)
+		return;
+
+	check(pv_mirror_is_available(m));
+	check(pv_mirror_set_result(m, true) == 0);
+	check(pv_mirror_is_available(m));
+
+	// skipped twice as long after each failure, up to the max
+	for (i = 0; i < 20; i++) {
+		check(pv_mirror_set_result(m, false) == secs);
+		check(!pv_mirror_is_available(m));
+		secs *= 2;
+		if (secs > MIRROR_RETRY_MAX)
+			secs = MIRROR_RETRY_MAX;
+	}
+
+	// one success resets it
+	check(pv_mirror_set_result(m, true) == 0);
+	check(pv_mirror_is_available(m));
+	check(pv_mirror_set_result(m, false) == MIRROR_RETRY_MIN);
+
+	pv_mirrors_free();
+}
+
+int main(void)
+{
+	test_load();
+	test_backoff();
+
+	return test_done();
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2021 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include "ratelimit.h"
+#include "test.h"
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// ms spent consuming bytes
+static uint64_t consume_ms(struct ratelimit *rl, size_t bytes)
+{
+	uint64_t start = now_ms();
+
+	ratelimit_consume(rl, bytes);
+	return now_ms() - start;
+}
+
+static void test_set(void)
+{
+	struct ratelimit rl = RATELIMIT_INIT;
+
+	check(!ratelimit_set(&rl, 10, NULL));
+	check(rl.rate == 10 * 1024);
+	check(rl.window_start == -1);
+
+	check(!ratelimit_set(&rl, 0, ""));
+	check(rl.rate == 0);
+
+	check(!ratelimit_set(&rl, 1, "22:00-06:30"));
+	check(rl.window_start == 22 * 60);
+	check(rl.window_end == 6 * 60 + 30);
+
+	// bad windows leave the limit all day
+	check(ratelimit_set(&rl, 1, "22:00") == -1);
+	check(rl.window_start == -1);
+	check(ratelimit_set(&rl, 1, "24:00-06:00") == -1);
+	check(rl.window_start == -1);
+	check(ratelimit_set(&rl, 1, "10:60-11:00") == -1);
+	check(rl.window_start == -1);
+	check(rl.rate == 1024);
+}
+
+static void test_limit(void)
+{
+	struct ratelimit rl = RATELIMIT_INIT;
+	uint64_t ms;
+
+	// no limit never sleeps
+	check(!ratelimit_set(&rl, 0, NULL));
+	check(consume_ms(&rl, 64 * 1024 * 1024) < 100);
+
+	// the bucket starts full, so one second of traffic goes through
+	check(!ratelimit_set(&rl, 64, NULL));
+	check(consume_ms(&rl, 64 * 1024) < 100);
+
+	// half a second over the limit
+	ms = consume_ms(&rl, 32 * 1024);
+	check((ms >= 400) && (ms < 1000));
+}
+
+static void test_window(void)
+{
+	struct ratelimit rl = RATELIMIT_INIT;
+	char window[32];
+	struct tm tm;
+	time_t now;
+	int min;
+
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	min = tm.tm_hour * 60 + tm.tm_min;
+
+	// a window that starts in an hour does not limit now
+	snprintf(window, sizeof(window), "%02d:%02d-%02d:%02d",
+		((min + 60) % 1440) / 60, (min + 60) % 60,
+		((min + 120) % 1440) / 60, (min + 120) % 60);
+	check(!ratelimit_set(&rl, 1, window));
+	check(consume_ms(&rl, 1024 * 1024) < 100);
+
+	// one that covers now does
+	snprintf(window, sizeof(window), "%02d:%02d-%02d:%02d",
+		((min + 1380) % 1440) / 60, (min + 1380) % 60,
+		((min + 60) % 1440) / 60, (min + 60) % 60);
+	check(!ratelimit_set(&rl, 1, window));
+	check(consume_ms(&rl, 1024) < 100);
+	check(consume_ms(&rl, 512) >= 400);
+}
+
+static void test_throughput(void)
+{
+	struct ratelimit rl = RATELIMIT_INIT;
+	uint64_t throughput;
+
+	check(!ratelimit_set(&rl, 0, NULL));
+	check(ratelimit_get_throughput(&rl) == 0);
+
+	// measured once a second has passed since the last sample
+	ratelimit_consume(&rl, 100 * 1024);
+	usleep(1100 * 1000);
+	ratelimit_consume(&rl, 0);
+	throughput = ratelimit_get_throughput(&rl);
+	check((throughput > 80 * 1024) && (throughput <= 100 * 1024));
+
+	// idle transfers have no throughput
+	usleep(2100 * 1000);
+	check(ratelimit_get_throughput(&rl) == 0);
+}
+
+int main(void)
+{
+	test_set();
+	test_limit();
+	test_window();
+	test_throughput();
+
+	return test_done();
+}
@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <sys/stat.h>
 
@@ -42,6 +43,19 @@
 #define PANTAVISOR_EXTERNAL_LOGIN_HANDLER_FMT "/btools/%s.login"
 #define PV_TRESTCLIENT_MAX_READ 4096
 
+/*
+ * trest clients keep the cert list they are created with, so the reference
+ * taken on it is only dropped when the client is freed
+ */
+struct trest_client_certs {
+	trest_ptr client;
+	const char **cafiles;
+	struct dl_list list; // trest_client_certs
+};
+
+static DEFINE_DL_LIST(client_certs);
+static pthread_mutex_t client_certs_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static struct trest_response* external_login_handler (trest_ptr self, void* data)
 {
 	char loginhandler_cmd[PATH_MAX];
@@ -142,8 +156,9 @@ err:
 
 trest_ptr pv_get_trest_client(struct pantavisor *pv, struct pv_connection *conn)
 {
-	const char **cafiles;
-	trest_ptr client;
+	const char **cafiles = NULL;
+	struct trest_client_certs *c;
+	trest_ptr client = NULL;
 
 	if (!conn)
 		conn = pv->conn;
@@ -250,8 +265,42 @@ trest_ptr pv_get_trest_client(struct pantavisor *pv, struct pv_connection *conn)
 					!pv_config_get_creds_noproxyconnect());
 	}
 
+	// without an entry, the list is just never freed
+	c = calloc(1, sizeof(struct trest_client_certs));
+	if (c) {
+		c->client = client;
+		c->cafiles = cafiles;
+		dl_list_init(&c->list);
+		pthread_mutex_lock(&client_certs_lock);
+		dl_list_add_tail(&client_certs, &c->list);
+		pthread_mutex_unlock(&client_certs_lock);
+	}
+
 	return client;
 err:
+	pv_ph_put_certs(cafiles);
 	return NULL;
 }
 
+void pv_free_trest_client(trest_ptr client)
+{
+	struct trest_client_certs *c, *tmp;
+
+	if (!client)
+		return;
+
+	trest_free(client);
+
+	pthread_mutex_lock(&client_certs_lock);
+	dl_list_for_each_safe(c, tmp, &client_certs,
+			struct trest_client_certs, list) {
+		if (c->client != client)
+			continue;
+		dl_list_del(&c->list);
+		pv_ph_put_certs(c->cafiles);
+		free(c);
+		break;
+	}
+	pthread_mutex_unlock(&client_certs_lock);
+}
+
@@ -26,5 +26,7 @@
 #include "pantavisor.h"
 
 trest_ptr pv_get_trest_client(struct pantavisor *pv, struct pv_connection *conn);
+// frees a client from pv_get_trest_client, with its reference on the cert list
+void pv_free_trest_client(trest_ptr client);
 
 #endif /* PV_TRESTCLIENT_H */
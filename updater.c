@@ -19,6 +19,12 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
+
+// pipe2
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,10 +34,13 @@
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <sys/statfs.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <mtd/mtd-user.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include <thttp.h>
 #include <mbedtls/sha256.h>
@@ -41,6 +50,8 @@
 #include "trestclient.h"
 #include "updater.h"
 #include "utils/fs.h"
+#include "utils/ratelimit.h"
+#include "utils/dlstate.h"
 #include "objects.h"
 #include "parser/parser.h"
 #include "bootloader.h"
@@ -54,11 +65,25 @@
 #include "json.h"
 #include "fops.h"
 #include "signature.h"
+#include "chunks.h"
+#include "mirrors.h"
+#include "tsh.h"
+#include "metadata.h"
 
 #define MODULE_NAME			"updater"
 #define pv_log(level, msg, ...)		vlog(MODULE_NAME, level, msg, ## __VA_ARGS__)
 #include "log.h"
 
+#define HTTP_STATUS_PARTIAL_CONTENT	206
+#define HTTP_STATUS_METHOD_NOT_ALLOWED	405
+#define HTTP_STATUS_NOT_IMPLEMENTED	501
+
+static pthread_mutex_t download_lock = PTHREAD_MUTEX_INITIALIZER;
+// guards the creation of pv->remote
+static pthread_mutex_t remote_lock = PTHREAD_MUTEX_INITIALIZER;
+// shared by all download workers
+static struct ratelimit download_ratelimit = RATELIMIT_INIT;
+
 
 typedef int (*token_iter_f) (void *d1, void *d2, char *buf, jsmntok_t* tok, int c);
 
@@ -132,32 +157,37 @@ static char *unescape_utf8_to_apvii(char *buf, char *code, char c)
 	return new;
 }
 
-static int trail_remote_init(struct pantavisor *pv)
+/*
+ * The pantahub client is shared by the download workers, the progress
+ * reporter and pantahub.c, which owns it and its lock
+ */
+static trest_response_ptr trail_remote_do_request(trest_request_ptr req)
+{
+	return pv_ph_do_request(req);
+}
+
+static trest_auth_status_enum trail_remote_update_auth(struct pantavisor *pv)
+{
+	return pv_ph_update_auth(pv);
+}
+
+static int __trail_remote_init(struct pantavisor *pv)
 {
 	struct trail_remote *remote = NULL;
-	trest_auth_status_enum status = TREST_AUTH_STATUS_NOTAUTH;
-	trest_ptr client = 0;
 	char *endpoint_trail = NULL;
 
 	if (pv->remote ||
 		!pv_config_get_creds_id())
 		return 0;
 
-	client = pv_get_trest_client(pv, NULL);
-
-	if (!client) {
-		pv_log(INFO, "unable to create device client");
-		goto err;
-	}
-
-	status = trest_update_auth(client);
-	if (status != TREST_AUTH_STATUS_OK) {
+	if (pv_ph_update_auth(pv) != TREST_AUTH_STATUS_OK) {
 		pv_log(INFO, "unable to auth device client");
 		goto err;
 	}
 
 	remote = calloc(1, sizeof(struct trail_remote));
-	remote->client = client;
+	if (!remote)
+		goto err;
 
 	endpoint_trail = malloc((sizeof(DEVICE_TRAIL_ENDPOINT_FMT)
 		+ strlen(pv_config_get_creds_id())) * sizeof(char));
@@ -189,13 +219,19 @@ static int trail_remote_init(struct pantavisor *pv)
 		goto err;
 	sprintf(remote->endpoint_trail_inprogress, "%s%s", endpoint_trail, DEVICE_TRAIL_ENDPOINT_INPROGRESS);
 
+	if (pv_config_get_updater_combined_query()) {
+		remote->endpoint_trail_pending = (char*)calloc(1, strlen(endpoint_trail)
+			+ sizeof(DEVICE_TRAIL_ENDPOINT_PENDING));
+		if (!remote->endpoint_trail_pending)
+			goto err;
+		sprintf(remote->endpoint_trail_pending, "%s%s", endpoint_trail, DEVICE_TRAIL_ENDPOINT_PENDING);
+	}
+
 	pv->remote = remote;
 
 	return 0;
 
 err:
-	if (client)
-		free(client);
 	if (remote)
 		free(remote);
 	if (endpoint_trail)
@@ -204,6 +240,17 @@ err:
 	return -1;
 }
 
+static int trail_remote_init(struct pantavisor *pv)
+{
+	int ret;
+
+	pthread_mutex_lock(&remote_lock);
+	ret = __trail_remote_init(pv);
+	pthread_mutex_unlock(&remote_lock);
+
+	return ret;
+}
+
 static void object_update_json(struct object_update *object_update,
 		char *buffer, ssize_t buflen)
 {
@@ -225,11 +272,290 @@ static void object_update_json(struct object_update *object_update,
 			);
 }
 
-static int trail_remote_set_status(struct pantavisor *pv, struct pv_update *update, enum update_state status, const char *msg)
+static int trail_remote_put_status(struct pantavisor *pv, const char *rev,
+				const char *endpoint, bool remote, const char *json)
 {
 	int ret = 0;
 	trest_request_ptr req = 0;
 	trest_response_ptr res = 0;
+
+	// store progress in trails
+	if (rev)
+		pv_storage_set_rev_progress(rev, json);
+
+	// do not report to cloud if that is not possible
+	if (!remote ||
+		!pv->online ||
+		trail_remote_init(pv))
+		goto out;
+
+	req = trest_make_request(TREST_METHOD_PUT,
+				 (char*) endpoint,
+				 0, 0,
+				 (char*) json);
+
+	ret = -1;
+	res = trail_remote_do_request(req);
+	if (!res) {
+		pv_log(WARN, "HTTP request PUT %s could not be initialized", endpoint);
+	} else if (!res->code &&
+		res->status != TREST_AUTH_STATUS_OK) {
+		pv_log(WARN, "HTTP request PUT %s could not auth (status=%d)", endpoint, res->status);
+	} else if (res->code != THTTP_STATUS_OK) {
+		pv_log(WARN, "HTTP request PUT %s returned error (code=%d; body='%s')", endpoint, res->code, res->body);
+	} else {
+		pv_log(INFO, "remote state updated to %s", res->body);
+		ret = 0;
+	}
+
+out:
+	if (req)
+		trest_request_free(req);
+	if (res)
+		trest_response_free(res);
+
+	return ret;
+}
+
+/*
+ * Download progress is reported from a thread, so the download workers do
+ * not wait for the cloud or the disk. Only the last progress of each
+ * revision is kept, and it is sent every UPDATE_PROGRESS_FREQ at most
+ */
+struct progress_report {
+	char *rev;
+	char *endpoint;
+	char *json;
+	bool remote;
+	struct dl_list list; // progress_report
+};
+
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct dl_list reports; // progress_report
+	bool running;
+	bool stop;
+} progress_reporter = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+// taken with progress_reporter.lock held, so a status is never overtaken by older progress
+static pthread_mutex_t status_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void progress_report_free(struct progress_report *r)
+{
+	if (r->rev)
+		free(r->rev);
+	if (r->endpoint)
+		free(r->endpoint);
+	if (r->json)
+		free(r->json);
+	free(r);
+}
+
+// progress_reporter.lock must be held
+static struct progress_report* progress_reporter_get(const char *rev)
+{
+	struct progress_report *r, *tmp;
+
+	if (!progress_reporter.running)
+		return NULL;
+
+	dl_list_for_each_safe(r, tmp, &progress_reporter.reports,
+			struct progress_report, list) {
+		if (!strcmp(r->rev, rev))
+			return r;
+	}
+
+	return NULL;
+}
+
+/*
+ * Only called from the progress reporter and after it stops, never with
+ * download_lock held. Unchanged values are not written again
+ */
+static void trail_download_set_throughput(uint64_t throughput)
+{
+	static uint64_t last = UINT64_MAX;
+	char value[32];
+
+	if (throughput == last)
+		return;
+	last = throughput;
+
+	snprintf(value, sizeof(value), "%"PRIu64, throughput);
+	pv_metadata_add_devmeta(DEVMETA_KEY_PV_DOWNLOAD_THROUGHPUT, value);
+}
+
+static void* progress_reporter_run(void *arg)
+{
+	struct pantavisor *pv = (struct pantavisor*) arg;
+	struct progress_report *r;
+	struct timespec next;
+
+	pthread_mutex_lock(&progress_reporter.lock);
+	while (1) {
+		while (!progress_reporter.stop &&
+			dl_list_empty(&progress_reporter.reports))
+			pthread_cond_wait(&progress_reporter.cond, &progress_reporter.lock);
+
+		// pending reports are sent before stopping
+		r = dl_list_first(&progress_reporter.reports, struct progress_report, list);
+		if (!r)
+			break;
+		dl_list_del(&r->list);
+
+		pthread_mutex_lock(&status_lock);
+		pthread_mutex_unlock(&progress_reporter.lock);
+		trail_remote_put_status(pv, r->rev, r->endpoint, r->remote, r->json);
+		pthread_mutex_unlock(&status_lock);
+		progress_report_free(r);
+
+		trail_download_set_throughput(ratelimit_get_throughput(&download_ratelimit));
+
+		// what comes in the meantime replaces the pending report
+		clock_gettime(CLOCK_REALTIME, &next);
+		next.tv_sec += UPDATE_PROGRESS_FREQ;
+		pthread_mutex_lock(&progress_reporter.lock);
+		while (!progress_reporter.stop &&
+			(pthread_cond_timedwait(&progress_reporter.cond,
+				&progress_reporter.lock, &next) != ETIMEDOUT))
+			;
+	}
+	pthread_mutex_unlock(&progress_reporter.lock);
+
+	return NULL;
+}
+
+static void progress_reporter_start(struct pantavisor *pv)
+{
+	// the reporter must not be the one creating the remote
+	if (pv->online)
+		trail_remote_init(pv);
+
+	pthread_mutex_lock(&progress_reporter.lock);
+
+	if (progress_reporter.running)
+		goto out;
+
+	dl_list_init(&progress_reporter.reports);
+	progress_reporter.stop = false;
+	if (pthread_create(&progress_reporter.thread, NULL, progress_reporter_run, pv)) {
+		pv_log(WARN, "could not start progress reporter, progress will be sent in place");
+		goto out;
+	}
+	progress_reporter.running = true;
+
+out:
+	pthread_mutex_unlock(&progress_reporter.lock);
+}
+
+// sends what is pending and waits for the reporter to end
+static void progress_reporter_stop()
+{
+	pthread_mutex_lock(&progress_reporter.lock);
+	if (!progress_reporter.running) {
+		pthread_mutex_unlock(&progress_reporter.lock);
+		return;
+	}
+	progress_reporter.stop = true;
+	pthread_cond_signal(&progress_reporter.cond);
+	pthread_mutex_unlock(&progress_reporter.lock);
+
+	pthread_join(progress_reporter.thread, NULL);
+
+	pthread_mutex_lock(&progress_reporter.lock);
+	progress_reporter.running = false;
+	pthread_mutex_unlock(&progress_reporter.lock);
+}
+
+// returns -1 if the progress has to be sent in place
+static int progress_reporter_post(const char *rev, const char *endpoint,
+				bool remote, const char *json)
+{
+	int ret = -1;
+	struct progress_report *r;
+	char *dup;
+
+	if (!rev || !endpoint)
+		return -1;
+
+	pthread_mutex_lock(&progress_reporter.lock);
+
+	if (!progress_reporter.running)
+		goto out;
+
+	dup = strdup(json);
+	if (!dup)
+		goto out;
+
+	r = progress_reporter_get(rev);
+	if (r) {
+		free(r->json);
+		r->json = dup;
+		r->remote = remote;
+		ret = 0;
+		goto out;
+	}
+
+	r = calloc(1, sizeof(struct progress_report));
+	if (!r) {
+		free(dup);
+		goto out;
+	}
+	r->json = dup;
+	r->rev = strdup(rev);
+	r->endpoint = strdup(endpoint);
+	r->remote = remote;
+	if (!r->rev || !r->endpoint) {
+		progress_report_free(r);
+		goto out;
+	}
+	dl_list_init(&r->list);
+	dl_list_add_tail(&progress_reporter.reports, &r->list);
+	pthread_cond_signal(&progress_reporter.cond);
+	ret = 0;
+
+out:
+	pthread_mutex_unlock(&progress_reporter.lock);
+
+	return ret;
+}
+
+static int trail_remote_progress_objects_json(struct pv_update *update,
+					const char *msg, struct pv_json_buf *objects)
+{
+	char obj_json[512];
+	int i, ret = 0;
+
+	if (pv_json_buf_init(objects, 1024))
+		return -1;
+
+	for (i = 0; (i < update->progress_len) && (ret >= 0); i++) {
+		object_update_json(&update->progress_objects[i], obj_json, sizeof(obj_json));
+		ret = pv_json_buf_printf(objects, "%s%s", i ? "," : "", obj_json);
+	}
+	if (msg && (ret >= 0))
+		ret = pv_json_buf_printf(objects, "%s%s", i ? "," : "", msg);
+
+	if (ret < 0) {
+		pv_json_buf_free(objects);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int trail_remote_set_status(struct pantavisor *pv, struct pv_update *update, enum update_state status, const char *msg)
+{
+	int ret = 0;
+	struct pv_json_buf objects;
+	struct progress_report *stale;
+	char *rev = NULL;
+	bool remote;
 	char __json[1024];
 	char *json = __json;
 	char message[128];
@@ -287,6 +613,11 @@ static int trail_remote_set_status(struct pantavisor *pv, struct pv_update *upda
 			msg = "Unable to download and/or install update";
 		sprintf(json, DEVICE_STEP_STATUS_FMT, "WONTGO", msg, 0);
 		break;
+	case UPDATE_SKIPPED:
+		if (!msg)
+			msg = "Skipped in favor of a newer revision";
+		sprintf(json, DEVICE_STEP_STATUS_FMT, "WONTGO", msg, 0);
+		break;
 	case UPDATE_NO_SIGNATURE:
 		sprintf(json, DEVICE_STEP_STATUS_FMT,
 			"WONTGO", "State signatures cannot be verified", 0);
@@ -317,62 +648,32 @@ static int trail_remote_set_status(struct pantavisor *pv, struct pv_update *upda
 			"TESTING", "Awaiting to see if update is stable", 95);
 		break;
 	case UPDATE_DOWNLOAD_PROGRESS:
-		if (update->progress_objects) {
-			// form message
-			sprintf(message, "Retry %d of %d",
-				update->retries,
-				pv_config_get_updater_revision_retries());
-			// form retries string
-			if (update->total_update) {
-				object_update_json(update->total_update,
-						total_progress_json, sizeof(total_progress_json));
-			}
-			char *buff = update->progress_objects;
-			/*
-			 * append the message to the end of
-			 * progress_objects. Avoid another allocation,
-			 * and cleanup progress_objects from the msg location.
-			 */
-			int len = strlen(buff);
-
-			/*
-			 * if there are no previous objects,
-			 * we don't need to allocate buffer space.
-			 */
-			if (len) {
-				json = (char*)calloc(1, 
-						PATH_MAX + update->progress_size);
-			}
-			/*
-			 * we must post the total
-			 */
-			if (!json)
-				json = __json;
-			/*
-			 * just post the total and bail out.
-			 */
-			if (__json == json) {
-				sprintf(json, DEVICE_STEP_STATUS_FMT_PROGRESS_DATA,
-						"DOWNLOADING", message, 0, update->retries,
-						total_progress_json,
-						"");
-				break;
-			}
-			if (msg) {
-				if (len) {
-					strcat(buff + len, ",");
-					len += 1;
-				}
-				snprintf(buff + len,
-						pv->update->progress_size - len, "%s", msg);
-				len = (len > 0 ? len - 1 : len);
-			}
+		// form message
+		sprintf(message, "Retry %d of %d",
+			update->retries,
+			pv_config_get_updater_revision_retries());
+		// form retries string
+		sprintf(total_progress_json, "{}");
+		if (update->total_update) {
+			object_update_json(update->total_update,
+					total_progress_json, sizeof(total_progress_json));
+		}
+		// finished objects and the one in msg, if any
+		if (trail_remote_progress_objects_json(update, msg, &objects)) {
 			sprintf(json, DEVICE_STEP_STATUS_FMT_PROGRESS_DATA,
 					"DOWNLOADING", message, 0, update->retries,
 					total_progress_json,
-					update->progress_objects);
-			update->progress_objects[len] = '\0';
+					"");
+			break;
 		}
+		json = calloc(1, sizeof(__json) + objects.len);
+		if (!json)
+			json = __json;
+		sprintf(json, DEVICE_STEP_STATUS_FMT_PROGRESS_DATA,
+				"DOWNLOADING", message, 0, update->retries,
+				total_progress_json,
+				json != __json ? objects.buf : "");
+		pv_json_buf_free(&objects);
 		break;
 	default:
 		sprintf(json, DEVICE_STEP_STATUS_FMT,
@@ -380,41 +681,30 @@ static int trail_remote_set_status(struct pantavisor *pv, struct pv_update *upda
 		break;
 	}
 
-	// store progress in trails
 	if (update->pending && update->pending->rev)
-		pv_storage_set_rev_progress(update->pending->rev, json);
+		rev = update->pending->rev;
+	remote = !(update->pending && update->pending->local) &&
+		pv_get_instance()->remote_mode;
 
-	// do not report to cloud if that is not possible
-	if ((update->pending && update->pending->local) ||
-		!pv_get_instance()->remote_mode ||
-		!pv->online ||
-		trail_remote_init(pv))
+	if ((status == UPDATE_DOWNLOAD_PROGRESS) &&
+		!progress_reporter_post(rev, update->endpoint, remote, json))
 		goto out;
 
-	req = trest_make_request(TREST_METHOD_PUT,
-				 update->endpoint,
-				 0, 0,
-				 json);
-
-	ret = -1;
-	res = trest_do_json_request(pv->remote->client, req);
-	if (!res) {
-		pv_log(WARN, "HTTP request PUT %s could not be initialized", update->endpoint);
-	} else if (!res->code &&
-		res->status != TREST_AUTH_STATUS_OK) {
-		pv_log(WARN, "HTTP request PUT %s could not auth (status=%d)", update->endpoint, res->status);
-	} else if (res->code != THTTP_STATUS_OK) {
-		pv_log(WARN, "HTTP request PUT %s returned error (code=%d; body='%s')", update->endpoint, res->code, res->body);
-	} else {
-		pv_log(INFO, "remote state updated to %s", res->body);
-		ret = 0;
+	// a new status makes the pending progress of the revision stale
+	pthread_mutex_lock(&progress_reporter.lock);
+	if (rev) {
+		stale = progress_reporter_get(rev);
+		if (stale) {
+			dl_list_del(&stale->list);
+			progress_report_free(stale);
+		}
 	}
+	pthread_mutex_lock(&status_lock);
+	pthread_mutex_unlock(&progress_reporter.lock);
+	ret = trail_remote_put_status(pv, rev, update->endpoint, remote, json);
+	pthread_mutex_unlock(&status_lock);
 
 out:
-	if (req)
-		trest_request_free(req);
-	if (res)
-		trest_response_free(res);
 	if (json != __json)
 		free(json);
 
@@ -435,7 +725,7 @@ static int trail_get_steps_response(struct pantavisor *pv, char *endpoint, trest
 			endpoint,
 			0, 0, 0);
 
-	res = trest_do_json_request(remote->client, req);
+	res = trail_remote_do_request(req);
 	if (!res) {
 		pv_log(WARN, "HTTP request GET %s could not be initialized", endpoint);
 	} else if (!res->code &&
@@ -503,8 +793,6 @@ static struct pv_update* pv_update_new(const char *id, const char *rev, bool loc
 	u = calloc(1, sizeof(struct pv_update));
 	if (u) {
 		u->total_update = (struct object_update*) calloc(1, sizeof(struct object_update));
-		u->progress_size = PATH_MAX;
-		u->progress_objects = (char*)calloc(1, u->progress_size);
 		u->status = UPDATE_INIT;
 		u->retries = 0;
 		u->local = local;
@@ -524,10 +812,133 @@ out:
 	return u;
 }
 
+/*
+ * Numeric value of a trail revision, or -1 for revisions that are not
+ * plain numbers such as locals/...
+ */
+static int trail_steps_rev_number(const char *rev)
+{
+	const char *c;
+
+	if (!rev || !*rev)
+		return -1;
+
+	for (c = rev; *c; c++) {
+		if ((*c < '0') || (*c > '9'))
+			return -1;
+	}
+
+	return atoi(rev);
+}
+
+/*
+ * Highest numeric revision among the steps in res, or -1
+ */
+static int trail_steps_latest(trest_response_ptr res)
+{
+	jsmntok_t **arr = NULL, **arr_i;
+	char *rev;
+	int n, latest = -1;
+
+	if (!res || !res->json_tokv)
+		return latest;
+
+	n = res->json_tokv->size;
+	arr = jsmnutil_get_array_toks(res->body, res->json_tokv);
+	if (!arr)
+		return latest;
+
+	for (arr_i = arr; n > 0; arr_i++, n--) {
+		rev = pv_json_get_value(res->body, "rev", *arr_i,
+				res->json_tokc - (*arr_i - res->json_tokv));
+		if (!rev)
+			continue;
+		if (trail_steps_rev_number(rev) > latest)
+			latest = trail_steps_rev_number(rev);
+		free(rev);
+	}
+
+	jsmnutil_tokv_free(arr);
+	return latest;
+}
+
+/*
+ * Reports the steps in res between the running revision and latest as
+ * skipped. Returns the number of reported steps
+ */
+static int trail_steps_skip(struct pantavisor *pv, trest_response_ptr res, int latest)
+{
+	jsmntok_t **arr = NULL, **arr_i;
+	struct pv_update *update;
+	char *rev, msg[64];
+	int n, num, running, skipped = 0;
+
+	if (!res || !res->json_tokv)
+		return skipped;
+
+	// a local running revision is older than any step in the trail
+	running = trail_steps_rev_number(pv->state->rev);
+
+	n = res->json_tokv->size;
+	arr = jsmnutil_get_array_toks(res->body, res->json_tokv);
+	if (!arr)
+		return skipped;
+
+	snprintf(msg, sizeof(msg), "Skipped in favor of revision %d", latest);
+
+	for (arr_i = arr; n > 0; arr_i++, n--) {
+		rev = pv_json_get_value(res->body, "rev", *arr_i,
+				res->json_tokc - (*arr_i - res->json_tokv));
+		if (!rev)
+			continue;
+		// revisions that are not numbers cannot be ordered, leave them
+		num = trail_steps_rev_number(rev);
+		if ((num >= 0) && (num < latest) && (num > running)) {
+			update = pv_update_new(pv_config_get_creds_id(), rev, false);
+			if (update) {
+				pv_log(INFO, "skipping rev %s, rev %d is queued too", rev, latest);
+				trail_remote_set_status(pv, update, UPDATE_SKIPPED, msg);
+				pv_update_free(update);
+				skipped++;
+			}
+		}
+		free(rev);
+	}
+
+	jsmnutil_tokv_free(arr);
+	return skipped;
+}
+
+/*
+ * Jumps straight to the latest of the queued and new steps. The steps left
+ * behind are reported as skipped, so the next query returns the latest one
+ */
+static int trail_steps_coalesce(struct pantavisor *pv, trest_response_ptr res, char *newer_endpoint)
+{
+	trest_response_ptr newer = NULL;
+	int latest, newest, skipped;
+
+	latest = trail_steps_latest(res);
+	if (newer_endpoint &&
+		(trail_get_steps_response(pv, newer_endpoint, &newer) > 0)) {
+		newest = trail_steps_latest(newer);
+		if (newest > latest)
+			latest = newest;
+	}
+
+	skipped = trail_steps_skip(pv, res, latest);
+	skipped += trail_steps_skip(pv, newer, latest);
+
+	if (newer)
+		trest_response_free(newer);
+
+	return skipped;
+}
+
 static int trail_get_new_steps(struct pantavisor *pv)
 {
-	bool wrong_revision = false;
-	int ret = 0;
+	bool wrong_revision = false, coalesced = false;
+	int ret = 0, pending = -1;
 	char *state = 0, *rev = 0;
 	struct trail_remote *remote = pv->remote;
 	trest_response_ptr res = NULL;
@@ -550,6 +961,24 @@ static int trail_get_new_steps(struct pantavisor *pv)
 	if (pv->update)
 		goto new_update;
 
+	// one request is enough for an idle device to know there is nothing to
+	// do. If there is, the sequence below picks the step as it always did.
+	// Errors just fall back to the sequence, and an empty result is
+	// confirmed with it from time to time
+	if (remote->endpoint_trail_pending) {
+		pending = trail_get_steps_response(pv, remote->endpoint_trail_pending, &res);
+		if (!pending) {
+			remote->pending_idle++;
+			if (remote->pending_idle < DEVICE_TRAIL_PENDING_CONFIRM)
+				goto out;
+			remote->pending_idle = 0;
+		}
+		if (res) {
+			trest_response_free(res);
+			res = NULL;
+		}
+	}
+
 	// check for INPROGRESS updates
 	ret = trail_get_steps_response(pv, remote->endpoint_trail_inprogress, &res);
 	if (ret > 0) {
@@ -569,10 +998,14 @@ static int trail_get_new_steps(struct pantavisor *pv)
 		goto out;
 	}
 
+queued_update:
 	// check for QUEUED updates
 	ret = trail_get_steps_response(pv, remote->endpoint_trail_queued, &res);
 	if (ret > 0) {
 		pv_log(DEBUG, "found QUEUED revision");
+		if (!coalesced && pv_config_get_updater_coalesce() &&
+			(trail_steps_coalesce(pv, res, remote->endpoint_trail_new) > 0))
+			goto coalesce;
 		goto process_response;
 	} else if (ret < 0) {
 		goto out;
@@ -583,12 +1016,31 @@ new_update:
 	ret = trail_get_steps_response(pv, remote->endpoint_trail_new, &res);
 	if (ret > 0) {
 		pv_log(DEBUG, "found NEW revision");
+		if (!pv->update && !coalesced && pv_config_get_updater_coalesce() &&
+			(trail_steps_coalesce(pv, res, NULL) > 0))
+			goto coalesce;
 		goto process_response;
 	} else if (ret < 0) {
 		goto out;
 	}
+	goto process_response;
+
+coalesce:
+	// older steps are now skipped, so query again for the latest one
+	coalesced = true;
+	trest_response_free(res);
+	res = NULL;
+	goto queued_update;
 
 process_response:
+	// the sequence did not agree with the combined query, so the hub does
+	// not support it
+	if (((pending == 0) && res) || ((pending > 0) && !res)) {
+		pv_log(INFO, "combined step query not supported by remote, disabling it");
+		free(remote->endpoint_trail_pending);
+		remote->endpoint_trail_pending = NULL;
+	}
+
 	ret = 0;
 	// if we have no response, we go out normally
 	if (!res)
@@ -697,7 +1149,7 @@ static int trail_is_available(struct trail_remote *r)
 				 "/trails/",
 				 0, 0, 0);
 
-	res = trest_do_json_request(r->client, req);
+	res = trail_remote_do_request(req);
 	if (!res) {
 		pv_log(WARN, "GET /trails/ could not be initialized");
 	} else if (!res->code &&
@@ -862,7 +1314,7 @@ static int trail_put_object(struct pantavisor *pv, struct pv_object *o, const ch
 				0,
 				body);
 
-	tres = trest_do_json_request(pv->remote->client, treq);
+	tres = trail_remote_do_request(treq);
 	if (!tres) {
 		pv_log(WARN, "POST /objects/ could not be initialized");
 		goto out;
@@ -986,6 +1438,8 @@ static int trail_put_objects(struct pantavisor *pv)
 	}
 	pv_objects_iter_end;
 
+	pv_ph_put_certs(crtfiles);
+
 	return ret;
 }
 
@@ -995,7 +1449,7 @@ static int trail_first_boot(struct pantavisor *pv)
 	trest_response_ptr res;
 	trest_auth_status_enum status = TREST_AUTH_STATUS_NOTAUTH;
 
-	status = trest_update_auth(pv->remote->client);
+	status = trail_remote_update_auth(pv);
 	if (status != TREST_AUTH_STATUS_OK) {
 		pv_log(INFO, "cannot update auth token");
 		return -1;
@@ -1008,7 +1462,7 @@ static int trail_first_boot(struct pantavisor *pv)
 	}
 
 	req = trest_make_request(TREST_METHOD_POST, "/trails/", 0, 0, pv->state->json);
-	res = trest_do_json_request(pv->remote->client, req);
+	res = trail_remote_do_request(req);
 	if (!res) {
 		pv_log(WARN, "POST /trails/ could not be initialized");
 	} else if (!res->code &&
@@ -1037,7 +1491,7 @@ int pv_updater_check_for_updates(struct pantavisor *pv)
 		return 0;
 	}
 
-	if (trest_update_auth(pv->remote->client) != TREST_AUTH_STATUS_OK) {
+	if (trail_remote_update_auth(pv) != TREST_AUTH_STATUS_OK) {
 		pv_log(INFO, "cannot authenticate to cloud");
 		return 0;
 	}
@@ -1123,18 +1577,22 @@ static void pv_trail_remote_free(struct trail_remote *trail)
 		free(trail->endpoint_trail_queued);
 	if (trail->endpoint_trail_new)
 		free(trail->endpoint_trail_new);
-	if (trail->endpoint_trail_queued)
-		free(trail->endpoint_trail_queued);
+	if (trail->endpoint_trail_downloading)
+		free(trail->endpoint_trail_downloading);
 	if (trail->endpoint_trail_inprogress)
 		free(trail->endpoint_trail_inprogress);
+	if (trail->endpoint_trail_pending)
+		free(trail->endpoint_trail_pending);
 
 	free(trail);
 }
 
 void pv_trail_remote_remove(struct pantavisor *pv)
 {
+	pthread_mutex_lock(&remote_lock);
 	pv_trail_remote_free(pv->remote);
 	pv->remote = NULL;
+	pthread_mutex_unlock(&remote_lock);
 }
 
 void pv_update_test(struct pantavisor *pv)
@@ -1154,6 +1612,31 @@ void pv_update_test(struct pantavisor *pv)
 	}
 }
 
+/*
+ * Gives back the space reserved for the objects of an update that is not
+ * going to be downloaded anymore, along with their download state
+ */
+static void trail_download_release_objects(struct pantavisor *pv)
+{
+	char path[PATH_MAX], state_path[PATH_MAX], aux_path[PATH_MAX];
+	struct pv_object *o = NULL;
+
+	if (!pv->update->pending || pv->update->local)
+		return;
+
+	pv_objects_iter_begin(pv->update->pending, o) {
+		snprintf(path, sizeof(path), MMC_TMP_OBJ_FMT, o->objpath);
+		snprintf(state_path, sizeof(state_path), MMC_TMP_STATE_FMT, path);
+		snprintf(aux_path, sizeof(aux_path), "%s.new", state_path);
+		remove(aux_path);
+		remove(state_path);
+		snprintf(aux_path, sizeof(aux_path), MMC_TMP_DELTA_FMT, path);
+		remove(aux_path);
+		remove(path);
+	}
+	pv_objects_iter_end;
+}
+
 int pv_update_finish(struct pantavisor *pv)
 {
 	if (!pv->update)
@@ -1163,18 +1646,21 @@ int pv_update_finish(struct pantavisor *pv)
 	case UPDATE_FAILED:
 		pv_bootloader_set_failed();
 		pv_update_set_status(pv, UPDATE_FAILED);
+		trail_download_release_objects(pv);
 		pv_update_remove(pv);
 		pv_log(INFO, "update finished");
 		break;
 	case UPDATE_RETRY_DOWNLOAD:
 		if (pv->update->retries > pv_config_get_updater_revision_retries()) {
 			pv_update_set_status(pv, UPDATE_NO_DOWNLOAD);
+			trail_download_release_objects(pv);
 			pv_update_remove(pv);
 			pv_log(INFO, "update finished");
 			return 0;
 		}
 		break;
 	case UPDATE_NO_DOWNLOAD:
+		trail_download_release_objects(pv);
 		pv_update_remove(pv);
 		pv_log(INFO, "update finished");
 		break;
@@ -1197,6 +1683,7 @@ int pv_update_finish(struct pantavisor *pv)
 	default:
 		pv_update_set_status(pv, pv->update->status);
 		pv_log(WARN, "update finished during wrong state %d", pv->update->status);
+		trail_download_release_objects(pv);
 		pv_update_remove(pv);
 		break;
 	}
@@ -1204,12 +1691,76 @@ int pv_update_finish(struct pantavisor *pv)
 	return 0;
 }
 
+/*
+ * Returns when a signed url stops being valid, looking at the usual query
+ * parameters. Urls we cannot read are kept for a short time only
+ */
+static time_t trail_signed_url_expiry(const char *url)
+{
+	const char *date, *expires;
+	struct tm tm;
+
+	// AWS signature v4
+	date = strstr(url, "X-Amz-Date=");
+	expires = strstr(url, "X-Amz-Expires=");
+	if (date && expires) {
+		memset(&tm, 0, sizeof(tm));
+		if (sscanf(date + strlen("X-Amz-Date="), "%4d%2d%2dT%2d%2d%2dZ",
+			&tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+			&tm.tm_hour, &tm.tm_min, &tm.tm_sec) == 6) {
+			tm.tm_year -= 1900;
+			tm.tm_mon -= 1;
+			return timegm(&tm) + atol(expires + strlen("X-Amz-Expires="));
+		}
+	}
+
+	// AWS signature v2 and most CDNs use an absolute epoch
+	expires = strstr(url, "?Expires=");
+	if (!expires)
+		expires = strstr(url, "&Expires=");
+	if (expires)
+		return atol(expires + strlen("?Expires="));
+
+	return time(NULL) + SIGNED_URL_DEFAULT_TTL;
+}
+
+static int trail_object_set_meta(struct pv_object *o, char *buf, jsmntok_t *tokv, int tokc)
+{
+	char *size, *url;
+
+	size = pv_json_get_value(buf, "size", tokv, tokc);
+	if (size) {
+		o->size = atoll(size);
+		free(size);
+	}
+
+	free_member(o, sha256);
+	o->sha256 = pv_json_get_value(buf, "sha256sum", tokv, tokc);
+
+	url = pv_json_get_value(buf, "signed-geturl", tokv, tokc);
+	if (!url) {
+		pv_log(ERROR, "unable to get download url for object");
+		return -1;
+	}
+	url = unescape_utf8_to_apvii(url, "\\u0026", '&');
+	free_member(o, geturl);
+	o->geturl = url;
+	o->geturl_expires = trail_signed_url_expiry(url);
+
+	// optional list of content defined chunks the object is made of
+	if (pv_config_get_storage_chunks()) {
+		free_member(o, chunks);
+		o->chunks = pv_json_get_value(buf, "chunks", tokv, tokc);
+	}
+
+	return 0;
+}
+
 static int trail_download_get_meta(struct pantavisor *pv, struct pv_object *o)
 {
 	int ret = 0;
 	char *endpoint = 0;
-	char *url = 0;
-	char *prn, *size = NULL;
+	char *prn;
 	trest_request_ptr req = 0;
 	trest_response_ptr res = 0;
 
@@ -1227,7 +1778,7 @@ static int trail_download_get_meta(struct pantavisor *pv, struct pv_object *o)
 				 endpoint,
 				 0, 0, 0);
 
-	res = trest_do_json_request(pv->remote->client, req);
+	res = trail_remote_do_request(req);
 	if (!res) {
 		pv_log(WARN, "GET %s could not be initialized", endpoint);
 		goto out;
@@ -1240,22 +1791,8 @@ static int trail_download_get_meta(struct pantavisor *pv, struct pv_object *o)
 		goto out;
 	}
 
-	size = pv_json_get_value(res->body, "size",
-			res->json_tokv, res->json_tokc);
-	if (size)
-		o->size = atoll(size);
-
-	o->sha256 = pv_json_get_value(res->body, "sha256sum",
-				 res->json_tokv, res->json_tokc);
-
-	url = pv_json_get_value(res->body, "signed-geturl",
-				 res->json_tokv, res->json_tokc);
-	if (!url) {
-		pv_log(ERROR, "unable to get download url for object");
+	if (trail_object_set_meta(o, res->body, res->json_tokv, res->json_tokc))
 		goto out;
-	}
-	url = unescape_utf8_to_apvii(url, "\\u0026", '&');
-	o->geturl = url;
 
 	// FIXME:
 	// if (verify_url(url)) ret = 1;
@@ -1268,8 +1805,6 @@ out:
 		trest_response_free(res);
 	if (endpoint)
 		free(endpoint);
-	if (size)
-		free(size);
 
 	return ret;
 }
@@ -1290,86 +1825,1114 @@ static int obj_is_kernel_pvk(struct pantavisor *pv, struct pv_object *obj)
 	return 0;
 }
 
+static bool trail_object_needs_meta(struct pantavisor *pv, struct pv_object *o)
+{
+	struct stat st;
+
+	// already in the pool, there is nothing to download
+	if (!obj_is_kernel_pvk(pv, o) && !stat(o->objpath, &st))
+		return false;
+
+	// signed url still valid from a previous try
+	if (o->geturl && (time(NULL) + SIGNED_URL_MARGIN < o->geturl_expires))
+		return false;
+
+	return true;
+}
+
+static bool objects_resolve_unsupported = false;
+
+/*
+ * Gets the metadata of up to TRAIL_OBJECTS_RESOLVE_MAX objects with one
+ * request. Objects not present in the response are left untouched
+ */
+static void trail_download_get_meta_batch(struct pantavisor *pv, struct pv_object **batch, int count)
+{
+	int i, j, n, len, span, resolved = 0;
+	char *body = NULL, *id = NULL;
+	jsmntok_t **arr = NULL, **arr_i;
+	trest_request_ptr req = 0;
+	trest_response_ptr res = 0;
+
+	len = count * (64 + 3) + 3;
+	body = calloc(1, len * sizeof(char));
+	if (!body)
+		goto out;
+
+	n = sprintf(body, "[");
+	for (i = 0; i < count; i++)
+		n += sprintf(body + n, "%s\"%s\"", i ? "," : "", batch[i]->id);
+	sprintf(body + n, "]");
+
+	pv_log(DEBUG, "requesting metadata of %d objects", count);
+
+	req = trest_make_request(TREST_METHOD_POST,
+				 TRAIL_OBJECTS_RESOLVE_ENDPOINT,
+				 0, 0, body);
+
+	res = trail_remote_do_request(req);
+	if (!res) {
+		pv_log(WARN, "POST %s could not be initialized", TRAIL_OBJECTS_RESOLVE_ENDPOINT);
+		goto out;
+	} else if (!res->code &&
+		res->status != TREST_AUTH_STATUS_OK) {
+		pv_log(WARN, "POST %s could not auth (status=%d)", TRAIL_OBJECTS_RESOLVE_ENDPOINT, res->status);
+		goto out;
+	} else if ((res->code == THTTP_STATUS_NOT_FOUND) ||
+		(res->code == HTTP_STATUS_METHOD_NOT_ALLOWED) ||
+		(res->code == HTTP_STATUS_NOT_IMPLEMENTED)) {
+		pv_log(INFO, "server does not resolve objects in batch, using one request per object");
+		objects_resolve_unsupported = true;
+		goto out;
+	} else if (res->code != THTTP_STATUS_OK) {
+		pv_log(WARN, "POST %s returned error (code=%d; body='%s')",
+			TRAIL_OBJECTS_RESOLVE_ENDPOINT, res->code, res->body);
+		goto out;
+	}
+
+	if (!res->json_tokv || (res->json_tokv->type != JSMN_ARRAY))
+		goto out;
+
+	n = res->json_tokv->size;
+	arr = jsmnutil_get_array_toks(res->body, res->json_tokv);
+	if (!arr)
+		goto out;
+
+	for (arr_i = arr; n > 0; arr_i++, n--) {
+		// tokens that belong to this element
+		span = 1;
+		while (((*arr_i - res->json_tokv) + span < res->json_tokc) &&
+			((*arr_i)[span].start < (*arr_i)->end))
+			span++;
+
+		id = pv_json_get_value(res->body, "id", *arr_i, span);
+		if (!id)
+			continue;
+
+		for (j = 0; j < count; j++) {
+			if (strcmp(batch[j]->id, id))
+				continue;
+			if (!trail_object_set_meta(batch[j], res->body, *arr_i, span))
+				resolved++;
+		}
+		free(id);
+	}
+
+	pv_log(DEBUG, "resolved %d of %d objects in batch", resolved, count);
+
+out:
+	if (arr)
+		jsmnutil_tokv_free(arr);
+	if (req)
+		trest_request_free(req);
+	if (res)
+		trest_response_free(res);
+	if (body)
+		free(body);
+}
+
+/*
+ * Makes sure every object that has to be downloaded has a valid signed
+ * url, resolving them in batches and then one by one for the rest
+ */
+static int trail_download_resolve_objects(struct pantavisor *pv)
+{
+	int n = 0;
+	struct pv_object *o = NULL, **batch = NULL;
+
+	if (!objects_resolve_unsupported)
+		batch = calloc(TRAIL_OBJECTS_RESOLVE_MAX, sizeof(struct pv_object*));
+
+	if (batch) {
+		pv_objects_iter_begin(pv->update->pending, o) {
+			if (!trail_object_needs_meta(pv, o))
+				continue;
+
+			batch[n++] = o;
+			if (n == TRAIL_OBJECTS_RESOLVE_MAX) {
+				trail_download_get_meta_batch(pv, batch, n);
+				n = 0;
+			}
+		}
+		pv_objects_iter_end;
+
+		if (n && !objects_resolve_unsupported)
+			trail_download_get_meta_batch(pv, batch, n);
+		free(batch);
+	}
+
+	pv_objects_iter_begin(pv->update->pending, o) {
+		if (trail_object_needs_meta(pv, o) &&
+			!trail_download_get_meta(pv, o))
+			return -1;
+	}
+	pv_objects_iter_end;
+
+	return 0;
+}
+
 struct progress_update {
 	struct timer timer_next_update;
 	struct pantavisor *pv;
 	struct object_update *object_update;
 	struct pv_object *pv_object;
+	// only set for downloads that can be resumed
+	int fd;
+	char *tmp_path;
+	off_t offset;
+	off_t saved;
+	mbedtls_sha256_context *sha256_ctx;
+	bool hash_error;
+	off_t end;
+	off_t flushed;
 };
 
-static uint64_t get_update_size(struct pv_update *u)
+static uint64_t get_update_size(struct pv_update *u)
+{
+	uint64_t size = 0;
+	struct stat st;
+	struct pv_object *curr = NULL;
+
+	pv_objects_iter_begin(u->pending, curr) {
+		if (stat(curr->objpath, &st) < 0)
+			size += curr->size;
+	}
+	pv_objects_iter_end;
+
+	return size;
+}
+/*
+ * Compressed filesystems do not allocate what they are asked for, and glibc
+ * would emulate the reservation writing zeros
+ */
+static bool trail_download_can_reserve(void)
+{
+	return strcmp(pv_config_get_storage_fstype(), "jffs2") &&
+		strcmp(pv_config_get_storage_fstype(), "ubifs");
+}
+
+static int trail_download_object_reserve(int fd, struct pv_object *obj)
+{
+	int ret;
+
+	if ((obj->size <= 0) || !trail_download_can_reserve())
+		return 0;
+
+	ret = posix_fallocate(fd, 0, obj->size);
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Saves next to the tmp object up to where it is on disk, so an interrupted
+ * download can continue from there
+ */
+static void trail_download_state_save(struct progress_update *progress_update)
+{
+	char path[PATH_MAX];
+
+	// state must not point beyond what is on disk
+	if (fdatasync(progress_update->fd))
+		return;
+
+	snprintf(path, sizeof(path), MMC_TMP_STATE_FMT, progress_update->tmp_path);
+	if (dlstate_save(path, progress_update->pv_object->id, progress_update->offset))
+		return;
+
+	progress_update->saved = progress_update->offset;
+}
+
+// hashes the first len bytes of fd, leaving it at len
+static int trail_download_hash_prefix(int fd, off_t len, mbedtls_sha256_context *sha256_ctx)
+{
+	unsigned char buf[4096];
+	ssize_t bytes;
+
+	lseek(fd, 0, SEEK_SET);
+	while (len > 0) {
+		bytes = pv_fops_read_nointr(fd, (char*) buf,
+			len < (off_t) sizeof(buf) ? len : (off_t) sizeof(buf));
+		if (bytes <= 0)
+			return -1;
+		mbedtls_sha256_update(sha256_ctx, buf, bytes);
+		len -= bytes;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the offset to continue downloading from, with sha256_ctx set to
+ * the hash of what is already in fd, which is read again for that. Anything
+ * that cannot be trusted is dropped and the download starts over
+ */
+static off_t trail_download_state_load(struct pv_object *obj, char *tmp_path, int fd,
+					mbedtls_sha256_context *sha256_ctx)
+{
+	char path[PATH_MAX];
+	uint64_t offset;
+
+	mbedtls_sha256_init(sha256_ctx);
+	mbedtls_sha256_starts(sha256_ctx, 0);
+
+	snprintf(path, sizeof(path), MMC_TMP_STATE_FMT, tmp_path);
+	if (dlstate_load(path, obj->id, &offset) || !offset ||
+		((obj->size > 0) && ((off_t) offset >= obj->size)))
+		goto restart;
+
+	if (ftruncate(fd, offset))
+		goto restart;
+	trail_download_object_reserve(fd, obj);
+
+	if (trail_download_hash_prefix(fd, offset, sha256_ctx)) {
+		pv_log(WARN, "could not read what was downloaded of %s", obj->id);
+		mbedtls_sha256_starts(sha256_ctx, 0);
+		goto restart;
+	}
+	pv_log(INFO, "resuming download of %s from byte %"PRIu64, obj->id, offset);
+
+	return offset;
+
+restart:
+	remove(path);
+	if (ftruncate(fd, 0))
+		pv_log(WARN, "could not truncate %s: %s", tmp_path, strerror(errno));
+	trail_download_object_reserve(fd, obj);
+
+	return 0;
+}
+
+static void trail_download_state_remove(char *tmp_path)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), MMC_TMP_STATE_FMT, tmp_path);
+	remove(path);
+}
+
+/*
+ * hash what was just written, reading it back from the page cache
+ */
+static void trail_download_object_hash(struct progress_update *progress_update, ssize_t written)
+{
+	unsigned char buf[4096];
+	ssize_t bytes;
+
+	while (!progress_update->hash_error && (written > 0)) {
+		bytes = pread(progress_update->fd, buf,
+			written < (ssize_t) sizeof(buf) ? written : (ssize_t) sizeof(buf),
+			progress_update->offset);
+		if (bytes <= 0) {
+			progress_update->hash_error = true;
+			return;
+		}
+		mbedtls_sha256_update(progress_update->sha256_ctx, buf, bytes);
+		progress_update->offset += bytes;
+		written -= bytes;
+	}
+
+	if (!progress_update->hash_error &&
+		(progress_update->offset - progress_update->saved >= DOWNLOAD_STATE_INTERVAL))
+		trail_download_state_save(progress_update);
+}
+
+/*
+ * Keeps at most two windows of the object dirty in the page cache, so the
+ * final fsync does not stall the rest of the system with the whole object
+ */
+static void trail_download_object_writeback(struct progress_update *progress_update, ssize_t written)
+{
+	off_t window = (off_t) pv_config_get_updater_download_writeback() * 1024;
+
+	progress_update->end += written;
+	if (window <= 0)
+		return;
+
+	while (progress_update->end - progress_update->flushed >= window) {
+		pv_fops_writeback_window(progress_update->fd, progress_update->flushed, window);
+		progress_update->flushed += window;
+	}
+}
+
+// download_lock must be held
+static void trail_download_object_finished(struct pv_update *u, struct object_update *object_update)
+{
+	struct object_update *objects;
+	int size;
+
+	if (u->progress_len == u->progress_size) {
+		size = u->progress_size ? 2 * u->progress_size : 16;
+		objects = realloc(u->progress_objects, size * sizeof(struct object_update));
+		if (!objects) {
+			pv_log(ERROR, "Failed to allocate space for progress data");
+			return;
+		}
+		u->progress_objects = objects;
+		u->progress_size = size;
+	}
+
+	u->progress_objects[u->progress_len++] = *object_update;
+}
+
+/*
+ * see object_update
+ */
+static void trail_download_object_progress(ssize_t written, ssize_t chunk_size, void *obj)
+{
+	struct progress_update *progress_update = (struct progress_update*)obj;
+	struct pv_object *pv_object = NULL;
+	char *msg = NULL;
+	const int OBJ_JSON_SIZE = 1024;
+	struct object_update *total_update = NULL;
+
+	if (!obj)
+		return;
+
+	if (progress_update->sha256_ctx && (written > 0)) {
+		trail_download_object_hash(progress_update, written);
+		trail_download_object_writeback(progress_update, written);
+	}
+
+	// sleeping here slows down the reads from the socket
+	if (written > 0)
+		ratelimit_consume(&download_ratelimit, written);
+
+	// other download workers share the totals and the progress objects
+	pthread_mutex_lock(&download_lock);
+
+	total_update = progress_update->pv->update->total_update;
+	if (timer_current_state(&progress_update->timer_next_update).fin) {
+		if (chunk_size == written) {
+			progress_update->object_update->total_downloaded += chunk_size;
+			total_update->total_downloaded += chunk_size;
+			goto unlock;
+		}
+		/*
+		 * written != chunk_size then allow for
+		 * error message to be posted.
+		 */
+	}
+	pv_object = progress_update->pv_object;
+	if (!pv_object)
+		goto unlock;
+
+	msg = (char*)calloc(1, OBJ_JSON_SIZE);
+	if (!msg)
+		goto unlock;
+
+	if (written != chunk_size) {
+		pv_log(ERROR, "Error downloading object %s", pv_object->name);
+		goto out;
+	}
+	else {
+		progress_update->object_update->total_downloaded += chunk_size;
+		total_update->total_downloaded += chunk_size;
+		progress_update->object_update->current_time = time(NULL);
+		object_update_json(progress_update->object_update, msg, OBJ_JSON_SIZE);
+	}
+	timer_start(&progress_update->timer_next_update, UPDATE_PROGRESS_FREQ, 0, RELATIV_TIMER);
+	pv_update_set_status_msg(progress_update->pv, UPDATE_DOWNLOAD_PROGRESS, msg);
+out:
+	free(msg);
+unlock:
+	pthread_mutex_unlock(&download_lock);
+}
+
+/*
+ * Creates a GET request for a signed url. host is allocated here and must
+ * be freed by the caller after the request. Plain http is only allowed
+ * for urls that serve content we verify, like mirrors
+ */
+static thttp_request_t* trail_download_request_new(char *url, const char **crtfiles,
+						char **host, bool allow_http)
+{
+	int n;
+	bool plain;
+	char *start = 0, *port = 0, *end = 0;
+	thttp_request_tls_t* tls_req = 0;
+	thttp_request_t* req = 0;
+
+	// SSL is mandatory
+	plain = allow_http && !strncmp(url, "http://", 7);
+	if (!plain && strncmp(url, "https://", 8) != 0) {
+		pv_log(INFO, "object url (%s) is invalid", url);
+		return NULL;
+	}
+
+	tls_req = thttp_request_tls_new_0 ();
+	tls_req->crtfiles = (char ** )crtfiles;
+
+	req = (thttp_request_t*) tls_req;
+
+	req->user_agent = pv_user_agent;
+	req->method = THTTP_METHOD_GET;
+	req->proto = THTTP_PROTO_HTTP;
+	req->proto_version = THTTP_PROTO_VERSION_10;
+	req->port = 443;
+
+	start = url + 8;
+	if (plain) {
+		req->is_tls = false;
+		req->port = 80;
+		start = url + 7;
+	}
+	end = strchr(start, '/');
+	if (!end)
+		end = start + strlen(start);
+	port = strchr(start, ':');
+	if (port && (port < end)) {
+		int p = strtol (port + 1, &end, 0);
+		if (p > 0)
+		req->port = p;
+		// host ends before the port
+		n = (unsigned long) port - (unsigned long) start;
+	} else {
+		n = (unsigned long) end - (unsigned long) start;
+	}
+
+	*host = malloc((n+1) * sizeof(char));
+	strncpy(*host, start, n);
+	(*host)[n] = '\0';
+
+	req->host = *host;
+	req->host_proxy = pv_config_get_creds_host_proxy();
+	req->port_proxy = pv_config_get_creds_port_proxy();
+	req->proxyconnect = !pv_config_get_creds_noproxyconnect();
+	if (req->is_tls) {
+		req->baseurl = calloc(1, sizeof(char)*(strlen("https://") + strlen(req->host) + 1 /* : */ + 5 /* port */ + 2 /* 0-delim */));
+		sprintf(req->baseurl, "https://%s:%d", req->host, req->port);
+	} else {
+		((thttp_request_tls_t*)req)->crtfiles = NULL;
+		req->baseurl = calloc(1, sizeof(char)*(strlen("https://") + strlen(req->host) + 1 /* : */ + 5 /* port */ + 2 /* 0-delim */));
+		sprintf(req->baseurl, "http://%s:%d", req->host, req->port);
+	}
+
+	if (req->host_proxy)
+		req->is_tls = false; /* XXX: global config if proxy is tls is TBD */
+
+	req->path = end;
+	req->headers = 0;
+
+	return req;
+}
+
+static int trail_download_object_range(thttp_request_t *req, int fd,
+					off_t offset, off_t len,
+					struct progress_update *progress_update)
+{
+	int ret = -1;
+	char range[64];
+	char *headers[] = { range, NULL };
+	thttp_response_t *res;
+
+	snprintf(range, sizeof(range), "Range: bytes=%"PRIu64"-%"PRIu64,
+		(uint64_t) offset, (uint64_t) (offset + len - 1));
+
+	lseek(fd, offset, SEEK_SET);
+	req->headers = headers;
+	res = thttp_request_do_file_with_cb(req, fd,
+			trail_download_object_progress, progress_update);
+	req->headers = 0;
+
+	if (!res) {
+		pv_log(WARN, "range %s could not be downloaded: could not be initialized", range);
+		goto out;
+	} else if (res->code != HTTP_STATUS_PARTIAL_CONTENT) {
+		pv_log(WARN, "range %s could not be downloaded: returned HTTP code %d", range, res->code);
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	if (res)
+		thttp_response_free(res);
+
+	return ret;
+}
+
+static void trail_download_object_reset(int fd, struct progress_update *progress_update,
+					uint64_t downloaded)
+{
+	struct object_update *total_update = progress_update->pv->update->total_update;
+
+	pthread_mutex_lock(&download_lock);
+	total_update->total_downloaded -=
+		progress_update->object_update->total_downloaded - downloaded;
+	progress_update->object_update->total_downloaded = downloaded;
+	pthread_mutex_unlock(&download_lock);
+
+	if (ftruncate(fd, 0))
+		pv_log(WARN, "could not truncate tmp object: %s", strerror(errno));
+	trail_download_object_reserve(fd, progress_update->pv_object);
+	lseek(fd, 0, SEEK_SET);
+}
+
+/*
+ * Fills fd with the chunks of the object that are already in the pool and
+ * downloads the rest using HTTP ranges, merging adjacent missing chunks
+ */
+static int trail_download_object_chunks(struct pv_object *obj, thttp_request_t *req,
+					int fd, struct progress_update *progress_update)
+{
+	int ret = -1;
+	off_t reused, start = 0, len = 0;
+	uint64_t downloaded = progress_update->object_update->total_downloaded;
+	struct object_update *total_update = progress_update->pv->update->total_update;
+	struct pv_chunk *c, *tmp;
+	struct dl_list chunks;
+
+	dl_list_init(&chunks);
+
+	if (pv_chunks_parse(obj->chunks, obj->size, &chunks))
+		goto out;
+
+	if (ftruncate(fd, obj->size)) {
+		pv_log(WARN, "could not resize tmp object: %s", strerror(errno));
+		goto out;
+	}
+
+	reused = pv_chunks_assemble(&chunks, fd);
+	pv_log(INFO, "reused %"PRIu64" B of %"PRIu64" B from local chunks",
+		(uint64_t) reused, (uint64_t) obj->size);
+	pthread_mutex_lock(&download_lock);
+	progress_update->object_update->total_downloaded += reused;
+	total_update->total_downloaded += reused;
+	pthread_mutex_unlock(&download_lock);
+
+	dl_list_for_each_safe(c, tmp, &chunks, struct pv_chunk, list) {
+		if (c->local)
+			continue;
+
+		if (len && (start + len == c->offset)) {
+			len += c->size;
+			continue;
+		}
+
+		if (len && trail_download_object_range(req, fd, start, len, progress_update))
+			goto out;
+
+		start = c->offset;
+		len = c->size;
+	}
+
+	if (len && trail_download_object_range(req, fd, start, len, progress_update))
+		goto out;
+
+	ret = 0;
+
+out:
+	if (ret) {
+		pv_log(WARN, "chunked download failed, downloading whole object");
+		trail_download_object_reset(fd, progress_update, downloaded);
+	}
+	pv_chunks_free(&chunks);
+
+	return ret;
+}
+
+static int trail_download_get_delta_meta(struct pantavisor *pv, struct pv_object *o,
+					struct pv_object *base, char **url, char **sha)
+{
+	int ret = -1;
+	char *endpoint = 0;
+	trest_request_ptr req = 0;
+	trest_response_ptr res = 0;
+
+	endpoint = malloc((sizeof(TRAIL_OBJECT_DELTA_FMT) + strlen(o->id) + strlen(base->id)) * sizeof(char));
+	if (!endpoint)
+		goto out;
+	sprintf(endpoint, TRAIL_OBJECT_DELTA_FMT, o->id, base->id);
+
+	pv_log(DEBUG, "requesting delta='%s'", endpoint);
+
+	req = trest_make_request(TREST_METHOD_GET,
+				 endpoint,
+				 0, 0, 0);
+
+	res = trail_remote_do_request(req);
+	if (!res) {
+		pv_log(WARN, "GET %s could not be initialized", endpoint);
+		goto out;
+	} else if (!res->code &&
+		res->status != TREST_AUTH_STATUS_OK) {
+		pv_log(WARN, "GET %s could not auth (status=%d)", endpoint, res->status);
+		goto out;
+	} else if (res->code != THTTP_STATUS_OK) {
+		pv_log(DEBUG, "GET %s returned no delta (code=%d)", endpoint, res->code);
+		goto out;
+	}
+
+	*sha = pv_json_get_value(res->body, "sha256sum",
+				 res->json_tokv, res->json_tokc);
+	*url = pv_json_get_value(res->body, "signed-geturl",
+				 res->json_tokv, res->json_tokc);
+	if (!*sha || !*url) {
+		pv_log(WARN, "delta metadata is not complete");
+		goto out;
+	}
+	*url = unescape_utf8_to_apvii(*url, "\\u0026", '&');
+
+	ret = 0;
+
+out:
+	if (req)
+		trest_request_free(req);
+	if (res)
+		trest_response_free(res);
+	if (endpoint)
+		free(endpoint);
+
+	return ret;
+}
+
+// returns 1 if the mirror does not have the object, -1 if the mirror failed
+static int trail_download_object_mirror_file(struct pv_mirror *m,
+					struct pv_object *obj, int fd)
+{
+	int src, ret = -1;
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", m->url + strlen("file://"), obj->id);
+	src = open(path, O_RDONLY);
+	if (src < 0)
+		return (errno == ENOENT) ? 1 : -1;
+
+	if (pv_fops_copy(src, fd) >= 0)
+		ret = 0;
+	close(src);
+
+	return ret;
+}
+
+// returns 1 if the mirror does not have the object, -1 if the mirror failed
+static int trail_download_object_mirror_http(struct pv_mirror *m,
+					struct pv_object *obj, const char **crtfiles, int fd,
+					struct progress_update *progress_update)
+{
+	int ret = -1;
+	char *url = NULL, *host = NULL;
+	thttp_request_t *req = NULL;
+	thttp_response_t *res = NULL;
+
+	url = calloc(1, strlen(m->url) + strlen(obj->id) + 2);
+	if (!url)
+		goto out;
+	sprintf(url, "%s/%s", m->url, obj->id);
+
+	req = trail_download_request_new(url, crtfiles, &host, true);
+	if (!req)
+		goto out;
+
+	lseek(fd, 0, SEEK_SET);
+	res = thttp_request_do_file_with_cb(req, fd,
+			trail_download_object_progress, progress_update);
+	if (!res || !res->code)
+		goto out;
+
+	if (res->code == THTTP_STATUS_OK)
+		ret = 0;
+	// the mirror works, it just does not have this object
+	else if (res->code < 500)
+		ret = 1;
+
+out:
+	if (url)
+		free(url);
+	if (host)
+		free(host);
+	if (req)
+		thttp_request_free(req);
+	if (res)
+		thttp_response_free(res);
+
+	return ret;
+}
+
+static int trail_download_object_mirrors(struct pantavisor *pv, struct pv_object *obj,
+					const char **crtfiles, int fd, char *tmp_path,
+					struct progress_update *progress_update)
+{
+	int ret;
+	uint64_t downloaded = progress_update->object_update->total_downloaded;
+	struct pv_mirror *m, *tmp;
+
+	dl_list_for_each_safe(m, tmp, pv_mirrors_get(),
+			struct pv_mirror, list) {
+		if (!pv_mirror_is_available(m))
+			continue;
+
+		if (!strncmp(m->url, "file://", strlen("file://")))
+			ret = trail_download_object_mirror_file(m, obj, fd);
+		else
+			ret = trail_download_object_mirror_http(m, obj, crtfiles, fd, progress_update);
+
+		if (!ret) {
+			fsync(fd);
+			if (pv_storage_validate_file_checksum(tmp_path, obj->sha256)) {
+				pv_log(WARN, "sha256 mismatch with object from mirror %s", m->url);
+				ret = -1;
+			}
+		}
+
+		if (ret <= 0)
+			pv_mirror_set_result(m, !ret);
+
+		if (!ret) {
+			// report the whole object as done
+			pthread_mutex_lock(&download_lock);
+			progress_update->pv->update->total_update->total_downloaded +=
+				obj->size - (progress_update->object_update->total_downloaded - downloaded);
+			progress_update->object_update->total_downloaded = downloaded + obj->size;
+			pthread_mutex_unlock(&download_lock);
+
+			pv_log(INFO, "object %s downloaded from mirror %s", obj->id, m->url);
+			return 0;
+		}
+
+		trail_download_object_reset(fd, progress_update, downloaded);
+	}
+
+	return -1;
+}
+
+struct trail_decompress {
+	int in_fd;
+	int out_fd;
+	int error;
+	mbedtls_sha256_context sha256_ctx;
+};
+
+// reads src to the end, hashing and writing to out_fd unless discard is set
+static void trail_decompress_drain(struct trail_decompress *d, int src, bool discard)
+{
+	char buf[4096];
+	ssize_t bytes;
+
+	while ((bytes = pv_fops_read_nointr(src, buf, sizeof(buf))) > 0) {
+		if (discard || d->error)
+			continue;
+		mbedtls_sha256_update(&d->sha256_ctx, (unsigned char *) buf, bytes);
+		if (pv_fops_write_nointr(d->out_fd, buf, bytes) != bytes)
+			d->error = -1;
+	}
+	if (!discard && (bytes < 0))
+		d->error = -1;
+}
+
+/*
+ * Sniffs the body for the gzip magic and either pipes it through
+ * TRAIL_DECOMPRESS_CMD or takes it as it is. The socket is always read to the
+ * end, so the download never writes to a closed reader
+ */
+static void *trail_decompress_run(void *arg)
+{
+	struct trail_decompress *d = arg;
+	unsigned char magic[2] = { 0 };
+	int in_p[] = { -1, -1 };
+	int out_p[] = { -1, -1 };
+	int status = -1;
+	pid_t pid;
+
+	if ((recv(d->in_fd, magic, sizeof(magic), MSG_PEEK | MSG_WAITALL) != sizeof(magic)) ||
+		(magic[0] != 0x1f) || (magic[1] != 0x8b)) {
+		pv_log(DEBUG, "body is not gzip encoded");
+		trail_decompress_drain(d, d->in_fd, false);
+		return NULL;
+	}
+
+	if (pipe2(out_p, O_CLOEXEC)) {
+		d->error = -1;
+		goto drain;
+	}
+
+	in_p[0] = d->in_fd;
+	pid = tsh_run_io(TRAIL_DECOMPRESS_CMD, 0, NULL, in_p, out_p, NULL);
+	close(out_p[1]);
+	if (pid < 0) {
+		d->error = -1;
+		goto drain;
+	}
+
+	trail_decompress_drain(d, out_p[0], false);
+
+	if ((waitpid(pid, &status, 0) != pid) ||
+		!WIFEXITED(status) || WEXITSTATUS(status)) {
+		pv_log(WARN, "body could not be decompressed with '%s'", TRAIL_DECOMPRESS_CMD);
+		d->error = -1;
+	}
+
+drain:
+	if (out_p[0] >= 0)
+		close(out_p[0]);
+	// whatever the decompressor left behind
+	trail_decompress_drain(d, d->in_fd, true);
+
+	return NULL;
+}
+
+/*
+ * Asks for a gzip encoded body and streams it into fd through
+ * trail_decompress_run, hashing what is written on the way. We do not get the
+ * response headers, so the body is only decompressed if it starts with the
+ * gzip magic: servers that ignore Accept-Encoding send the object as it is.
+ * On success, sha256_ctx holds the hash of what was written to fd
+ */
+static int trail_download_object_compressed(struct pantavisor *pv, struct pv_object *obj,
+					const char **crtfiles, int fd, mbedtls_sha256_context *sha256_ctx,
+					struct progress_update *progress_update)
+{
+	int ret = -1;
+	int sv[] = { -1, -1 };
+	uint64_t downloaded = progress_update->object_update->total_downloaded;
+	char *host = NULL;
+	char *headers[] = { "Accept-Encoding: gzip", NULL };
+	pthread_t tid;
+	bool running = false;
+	struct trail_decompress d = {
+		.out_fd = fd,
+	};
+	thttp_request_t *req = NULL;
+	thttp_response_t *res = NULL;
+
+	mbedtls_sha256_init(&d.sha256_ctx);
+	mbedtls_sha256_starts(&d.sha256_ctx, 0);
+
+	req = trail_download_request_new(obj->geturl, crtfiles, &host, false);
+	if (!req)
+		goto out;
+
+	lseek(fd, 0, SEEK_SET);
+	if (ftruncate(fd, 0))
+		goto out;
+
+	// a socket, so the decompress thread can peek at the first bytes
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+		pv_log(WARN, "could not create socket pair: %s", strerror(errno));
+		goto out;
+	}
+
+	d.in_fd = sv[1];
+	if (pthread_create(&tid, NULL, trail_decompress_run, &d)) {
+		pv_log(WARN, "could not start decompress thread");
+		goto out;
+	}
+	running = true;
+
+	pv_log(INFO, "downloading compressed object %s", obj->id);
+	req->headers = headers;
+	res = thttp_request_do_file_with_cb(req, sv[0],
+			trail_download_object_progress, progress_update);
+	req->headers = 0;
+
+	// lets the decompress thread see the end of the body
+	close(sv[0]);
+	sv[0] = -1;
+	pthread_join(tid, NULL);
+	running = false;
+
+	if (!res || (res->code != THTTP_STATUS_OK)) {
+		pv_log(WARN, "compressed object could not be downloaded");
+		goto out;
+	}
+
+	if (d.error) {
+		pv_log(WARN, "compressed object could not be written");
+		goto out;
+	}
+
+	// report the whole object as done
+	pthread_mutex_lock(&download_lock);
+	progress_update->pv->update->total_update->total_downloaded +=
+		obj->size - (progress_update->object_update->total_downloaded - downloaded);
+	progress_update->object_update->total_downloaded = downloaded + obj->size;
+	pthread_mutex_unlock(&download_lock);
+
+	mbedtls_sha256_clone(sha256_ctx, &d.sha256_ctx);
+	ret = 0;
+
+out:
+	if (sv[0] >= 0)
+		close(sv[0]);
+	if (running)
+		pthread_join(tid, NULL);
+	if (sv[1] >= 0)
+		close(sv[1]);
+	if (ret) {
+		pv_log(WARN, "compressed download failed, downloading whole object");
+		trail_download_object_reset(fd, progress_update, downloaded);
+	}
+	mbedtls_sha256_free(&d.sha256_ctx);
+	if (host)
+		free(host);
+	if (req)
+		thttp_request_free(req);
+	if (res)
+		thttp_response_free(res);
+
+	return ret;
+}
+
+/*
+ * Builds the object in fd from a delta against the object with the same
+ * name in the running revision, if the server has one
+ */
+static int trail_download_object_delta(struct pantavisor *pv, struct pv_object *obj,
+					const char **crtfiles, int fd, char *tmp_path,
+					struct progress_update *progress_update)
+{
+	int ret = -1, delta_fd = -1, status = -1;
+	int out_p[] = { -1, -1 };
+	uint64_t downloaded = progress_update->object_update->total_downloaded;
+	char *url = NULL, *sha = NULL, *host = NULL;
+	char delta_path[PATH_MAX];
+	char cmd[PATH_MAX * 2 + 64];
+	struct stat st;
+	struct pv_object *base;
+	thttp_request_t *req = NULL;
+	thttp_response_t *res = NULL;
+
+	base = pv_objects_get_by_name(pv->state, obj->name);
+	if (!base || !strcmp(base->id, obj->id) || stat(base->objpath, &st))
+		return -1;
+
+	ret = trail_download_get_delta_meta(pv, obj, base, &url, &sha);
+	if (ret)
+		goto free;
+	ret = -1;
+
+	req = trail_download_request_new(url, crtfiles, &host, false);
+	if (!req)
+		goto out;
+
+	snprintf(delta_path, sizeof(delta_path), MMC_TMP_DELTA_FMT, tmp_path);
+	delta_fd = open(delta_path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (delta_fd < 0) {
+		pv_log(WARN, "open failed for %s: %s", delta_path, strerror(errno));
+		goto out;
+	}
+
+	pv_log(INFO, "downloading delta for object %s against %s", obj->id, base->id);
+	res = thttp_request_do_file_with_cb(req, delta_fd,
+			trail_download_object_progress, progress_update);
+	if (!res || (res->code != THTTP_STATUS_OK)) {
+		pv_log(WARN, "delta could not be downloaded");
+		goto out;
+	}
+	fsync(delta_fd);
+
+	if (pv_storage_validate_file_checksum(delta_path, sha)) {
+		pv_log(WARN, "sha256 mismatch with downloaded delta");
+		goto out;
+	}
+
+	snprintf(cmd, sizeof(cmd), TRAIL_DELTA_CMD_FMT, base->objpath, delta_path);
+	out_p[1] = fd;
+	if ((tsh_run_io(cmd, 1, &status, NULL, out_p, NULL) < 0) ||
+		!WIFEXITED(status) || WEXITSTATUS(status)) {
+		pv_log(WARN, "delta could not be applied with '%s'", cmd);
+		goto out;
+	}
+	fsync(fd);
+
+	if (pv_storage_validate_file_checksum(tmp_path, obj->sha256)) {
+		pv_log(WARN, "sha256 mismatch with object built from delta");
+		goto out;
+	}
+
+	// report the whole object as done
+	pthread_mutex_lock(&download_lock);
+	progress_update->pv->update->total_update->total_downloaded +=
+		obj->size - (progress_update->object_update->total_downloaded - downloaded);
+	progress_update->object_update->total_downloaded = downloaded + obj->size;
+	pthread_mutex_unlock(&download_lock);
+
+	ret = 0;
+
+out:
+	if (ret) {
+		pv_log(WARN, "delta download failed, downloading whole object");
+		trail_download_object_reset(fd, progress_update, downloaded);
+	}
+	if (delta_fd >= 0) {
+		close(delta_fd);
+		remove(delta_path);
+	}
+free:
+	if (url)
+		free(url);
+	if (sha)
+		free(sha);
+	if (host)
+		free(host);
+	if (req)
+		thttp_request_free(req);
+	if (res)
+		thttp_response_free(res);
+
+	return ret;
+}
+
+/*
+ * Servers that ignore Range answer with the whole object, which lands in fd
+ * after the offset we resumed from. It is moved to the start of fd, so it
+ * does not have to be downloaded again
+ */
+static int trail_download_object_unshift(int fd, off_t offset)
 {
-	uint64_t size = 0;
+	unsigned char buf[4096];
+	off_t pos = 0, size;
+	ssize_t bytes;
 	struct stat st;
-	struct pv_object *curr = NULL;
 
-	pv_objects_iter_begin(u->pending, curr) {
-		if (stat(curr->objpath, &st) < 0)
-			size += curr->size;
+	if (fstat(fd, &st) || (st.st_size <= offset))
+		return -1;
+
+	size = st.st_size - offset;
+	while (pos < size) {
+		bytes = (size - pos) < (off_t) sizeof(buf) ? size - pos : sizeof(buf);
+		bytes = pread(fd, buf, bytes, offset + pos);
+		if (bytes <= 0)
+			return -1;
+		if (pwrite(fd, buf, bytes, pos) != bytes)
+			return -1;
+		pos += bytes;
 	}
-	pv_objects_iter_end;
 
-	return size;
+	return ftruncate(fd, size);
 }
+
 /*
- * see object_update
+ * Takes the bytes counted for an object out of the update totals when what
+ * was downloaded is discarded
  */
-static void trail_download_object_progress(ssize_t written, ssize_t chunk_size, void *obj)
+static void trail_download_object_discount(struct pantavisor *pv,
+					struct object_update *object_update, uint64_t bytes)
 {
-	struct progress_update *progress_update = (struct progress_update*)obj;
-	struct pv_object *pv_object = NULL;
-	char *msg = NULL;
-	const int OBJ_JSON_SIZE = 1024;
-	struct object_update *total_update = NULL;
-
-	if (!obj)
-		return;
-	total_update = progress_update->pv->update->total_update;
-	if (timer_current_state(&progress_update->timer_next_update).fin) {
-		if (chunk_size == written) {
-			progress_update->object_update->total_downloaded += chunk_size;
-			total_update->total_downloaded += chunk_size;
-			return;
-		}
-		/*
-		 * written != chunk_size then allow for
-		 * error message to be posted.
-		 */
-	}
-	pv_object = progress_update->pv_object;
-	if (!pv_object)
-		return;
-
-	msg = (char*)calloc(1, OBJ_JSON_SIZE);
-	if (!msg)
-		return;
-
-	if (written != chunk_size) {
-		pv_log(ERROR, "Error downloading object %s", pv_object->name);
-		goto out;
-	}
-	else {
-		progress_update->object_update->total_downloaded += chunk_size;
-		total_update->total_downloaded += chunk_size;
-		progress_update->object_update->current_time = time(NULL);
-		object_update_json(progress_update->object_update, msg, OBJ_JSON_SIZE);
-	}
-	timer_start(&progress_update->timer_next_update, UPDATE_PROGRESS_FREQ, 0, RELATIV_TIMER);
-	pv_update_set_status_msg(progress_update->pv, UPDATE_DOWNLOAD_PROGRESS, msg);
-out:
-	free(msg);
+	pthread_mutex_lock(&download_lock);
+	if (pv->update && pv->update->total_update)
+		pv->update->total_update->total_downloaded -= bytes;
+	object_update->total_downloaded -= bytes;
+	pthread_mutex_unlock(&download_lock);
 }
 
 static int trail_download_object(struct pantavisor *pv, struct pv_object *obj, const char **crtfiles)
 {
 	int ret = 0;
 	int volatile_tmp_fd = -1, fd = -1, obj_fd = -1;
-	int bytes, n;
+	int bytes;
 	int is_kernel_pvk;
 	int use_volatile_tmp = 0;
+	bool resumable, hashed = false;
+	off_t offset = 0;
+	char range[64];
+	char *headers[] = { range, NULL };
 	char *tmp_sha;
 	char *host = 0;
-	char *start = 0, *port = 0, *end = 0;
 	char mmc_tmp_obj_path [PATH_MAX];
 	char volatile_tmp_obj_path[] = VOLATILE_TMP_OBJ_PATH;
 	unsigned char buf[4096];
@@ -1378,7 +2941,6 @@ static int trail_download_object(struct pantavisor *pv, struct pv_object *obj, c
 	struct stat st;
 	mbedtls_sha256_context sha256_ctx;
 	thttp_response_t* res = 0;
-	thttp_request_tls_t* tls_req = 0;
 	thttp_request_t* req = 0;
 	struct object_update object_update;
 	struct progress_update progress_update = {
@@ -1389,16 +2951,6 @@ static int trail_download_object(struct pantavisor *pv, struct pv_object *obj, c
 	if (!obj)
 		goto out;
 
-	tls_req = thttp_request_tls_new_0 ();
-	tls_req->crtfiles = (char ** )crtfiles;
-
-	req = (thttp_request_t*) tls_req;
-
-	req->user_agent = pv_user_agent;
-	req->method = THTTP_METHOD_GET;
-	req->proto = THTTP_PROTO_HTTP;
-	req->proto_version = THTTP_PROTO_VERSION_10;
-
 	is_kernel_pvk = obj_is_kernel_pvk(pv, obj);
 	if (!is_kernel_pvk && stat(obj->objpath, &st) == 0) {
 		pv_log(DEBUG, "file exists (%s)", obj->objpath);
@@ -1411,52 +2963,18 @@ static int trail_download_object(struct pantavisor *pv, struct pv_object *obj, c
 		goto out;
 	}
 
-	// SSL is mandatory
-	if (strncmp(obj->geturl, "https://", 8) != 0) {
-		pv_log(INFO, "object url (%s) is invalid", obj->geturl);
+	req = trail_download_request_new(obj->geturl, crtfiles, &host, false);
+	if (!req)
 		goto out;
-	}
-	req->port = 443;
-
-	start = obj->geturl + 8;
-	port = strchr(start, ':');
-	if (port) {
-		int p = strtol (++port, &end, 0);
-		if (p > 0)
-		req->port = p;
-	} else {
-		end = strchr(start, '/');
-	}
-
-	n = (unsigned long) end - (unsigned long) start;
-	host = malloc((n+1) * sizeof(char));
-	strncpy(host, start, n);
-	host[n] = '\0';
-
-	req->host = host;
-	req->host_proxy = pv_config_get_creds_host_proxy();
-	req->port_proxy = pv_config_get_creds_port_proxy();
-	req->proxyconnect = !pv_config_get_creds_noproxyconnect();
-	if (req->is_tls) {
-		req->baseurl = calloc(1, sizeof(char)*(strlen("https://") + strlen(req->host) + 1 /* : */ + 5 /* port */ + 2 /* 0-delim */));
-		sprintf(req->baseurl, "https://%s:%d", req->host, req->port);
-	} else {
-		((thttp_request_tls_t*)req)->crtfiles = NULL;
-		req->baseurl = calloc(1, sizeof(char)*(strlen("https://") + strlen(req->host) + 1 /* : */ + 5 /* port */ + 2 /* 0-delim */));
-		sprintf(req->baseurl, "http://%s:%d", req->host, req->port);
-	}
-
-	if (req->host_proxy)
-		req->is_tls = false; /* XXX: global config if proxy is tls is TBD */
-
-	req->path = end;
-	req->headers = 0;
 
 	if (pv_config_get_updater_network_use_tmp_objects() &&
 		(!strcmp(pv_config_get_storage_fstype(), "jffs2") ||
 	    !strcmp(pv_config_get_storage_fstype(), "ubifs")))
 		use_volatile_tmp = 1;
 
+	if (pv_objects_mkdir(obj->id))
+		goto out;
+
 	// temporary path where we will store the file until validated
 	sprintf(mmc_tmp_obj_path, MMC_TMP_OBJ_FMT, obj->objpath);
 	obj_fd = open(mmc_tmp_obj_path, O_CREAT | O_RDWR, 0644);
@@ -1489,40 +3007,108 @@ static int trail_download_object(struct pantavisor *pv, struct pv_object *obj, c
 	object_update.current_time = object_update.start_time;
 	object_update.total_downloaded = 0;
 	timer_start(&progress_update.timer_next_update, UPDATE_PROGRESS_FREQ, 0, RELATIV_TIMER);
+
+	// only downloads straight to storage survive a reboot
+	resumable = !use_volatile_tmp && !is_kernel_pvk;
+	if (resumable)
+		offset = trail_download_state_load(obj, mmc_tmp_obj_path, fd, &sha256_ctx);
+
+	if (!offset && resumable &&
+		!trail_download_object_mirrors(pv, obj, crtfiles, fd, mmc_tmp_obj_path, &progress_update))
+		goto downloaded;
+
+	if (!offset && pv_config_get_updater_delta() && resumable &&
+		!trail_download_object_delta(pv, obj, crtfiles, fd, mmc_tmp_obj_path, &progress_update))
+		goto downloaded;
+
+	if (!offset && obj->chunks && resumable &&
+		!trail_download_object_chunks(obj, req, fd, &progress_update))
+		goto downloaded;
+
+	if (!offset && pv_config_get_updater_download_compression() && resumable &&
+		!trail_download_object_compressed(pv, obj, crtfiles, fd, &sha256_ctx, &progress_update)) {
+		hashed = true;
+		goto downloaded;
+	}
+
+	if (resumable) {
+		progress_update.fd = fd;
+		progress_update.tmp_path = mmc_tmp_obj_path;
+		progress_update.offset = offset;
+		progress_update.saved = offset;
+		progress_update.sha256_ctx = &sha256_ctx;
+		progress_update.end = offset;
+		progress_update.flushed = offset;
+	}
+
+	if (offset) {
+		snprintf(range, sizeof(range), "Range: bytes=%"PRIu64"-", (uint64_t) offset);
+		req->headers = headers;
+		lseek(fd, offset, SEEK_SET);
+		object_update.total_downloaded = offset;
+		pthread_mutex_lock(&download_lock);
+		pv->update->total_update->total_downloaded += offset;
+		pthread_mutex_unlock(&download_lock);
+	}
+
 	res = thttp_request_do_file_with_cb (req, fd,
 			trail_download_object_progress, &progress_update);
+	req->headers = 0;
 	if (!res) {
 		pv_log(WARN, "'%s' could not be downloaded: could not be initialized", obj->id);
-		remove(mmc_tmp_obj_path);
-		goto out;
+		goto interrupted;
 	} else if (!res->code) {
 		pv_log(WARN, "'%s' could not be downloaded: got no response", obj->id);
-		remove(mmc_tmp_obj_path);
-		goto out;
-	} else if (res->code != THTTP_STATUS_OK) {
+		goto interrupted;
+	} else if (offset && (res->code == THTTP_STATUS_OK)) {
+		pv_log(WARN, "'%s' could not be resumed: server does not support ranges", obj->id);
+		// what we had is replaced by the whole object, which is hashed again
+		trail_download_object_discount(pv, &object_update, offset);
+		if (trail_download_object_unshift(fd, offset)) {
+			trail_download_object_discount(pv, &object_update,
+				object_update.total_downloaded);
+			trail_download_state_remove(mmc_tmp_obj_path);
+			remove(mmc_tmp_obj_path);
+			goto out;
+		}
+		goto downloaded;
+	} else if (res->code != (offset ? HTTP_STATUS_PARTIAL_CONTENT : THTTP_STATUS_OK)) {
 		pv_log(WARN, "'%s' could not be downloaded: returned HTTP error (code=%d; body='%s')",
 			obj->id, res->code, res->body);
-		remove(mmc_tmp_obj_path);
-		goto out;
+		// do not trust the cached url anymore
+		obj->geturl_expires = 0;
+		goto interrupted;
 	}
 
+	hashed = resumable && !progress_update.hash_error;
+
 	if (use_volatile_tmp) {
 		pv_log(INFO, "copying %s to tmp path (%s)", volatile_tmp_obj_path, mmc_tmp_obj_path);
 		bytes = pv_fops_copy_and_close(volatile_tmp_fd, obj_fd);
+		remove(volatile_tmp_obj_path);
 		fd = obj_fd;
+		if (bytes < 0) {
+			pv_log(ERROR, "unable to copy %s to %s: %s", volatile_tmp_obj_path,
+				mmc_tmp_obj_path, strerror(errno));
+			goto interrupted;
+		}
 	}
+downloaded:
 	pv_log(DEBUG, "downloaded object to tmp path (%s)", mmc_tmp_obj_path);
 	fsync(fd);
 	object_update.current_time = time(NULL);
+	trail_download_state_remove(mmc_tmp_obj_path);
 
+	// verify file downloaded correctly before syncing to disk. Objects
+	// downloaded in one go were already hashed while being written
+	if (!hashed) {
+		lseek(fd, 0, SEEK_SET);
+		mbedtls_sha256_init(&sha256_ctx);
+		mbedtls_sha256_starts(&sha256_ctx, 0);
 
-	// verify file downloaded correctly before syncing to disk
-	lseek(fd, 0, SEEK_SET);
-	mbedtls_sha256_init(&sha256_ctx);
-	mbedtls_sha256_starts(&sha256_ctx, 0);
-
-	while ((bytes = read(fd, buf, 4096)) > 0) {
-		mbedtls_sha256_update(&sha256_ctx, buf, bytes);
+		while ((bytes = read(fd, buf, 4096)) > 0) {
+			mbedtls_sha256_update(&sha256_ctx, buf, bytes);
+		}
 	}
 
 	mbedtls_sha256_finish(&sha256_ctx, local_sha);
@@ -1540,6 +3126,8 @@ static int trail_download_object(struct pantavisor *pv, struct pv_object *obj, c
 	for (int i = 0; i < 32; i++) {
 		if (cloud_sha[i] != local_sha[i]) {
 			pv_log(WARN, "sha256 mismatch with local object");
+			trail_download_object_discount(pv, &object_update,
+				object_update.total_downloaded);
 			remove(mmc_tmp_obj_path);
 			goto out;
 		}
@@ -1548,52 +3136,25 @@ static int trail_download_object(struct pantavisor *pv, struct pv_object *obj, c
 
 	pv_log(DEBUG, "verified object (%s), renaming from (%s)", obj->objpath, mmc_tmp_obj_path);
 	rename(mmc_tmp_obj_path, obj->objpath);
+	pv_objects_link_flat(obj->id);
 
-	ret = 1;
-	if (pv->update && pv->update->progress_objects) {
-		int data_len = strlen(pv->update->progress_objects);
-		char this_obj_json[512];
-		int to_write = 0;
-		int remaining = pv->update->progress_size - data_len - 1;
-		bool can_write = true;
+	if (pv_config_get_storage_chunks())
+		pv_chunks_index_object(obj->id);
 
-		/*
-		 * Use a placeholder for this object's json.
-		 */
-		object_update_json(&object_update, this_obj_json,
-					sizeof(this_obj_json));
-		to_write += strlen(this_obj_json);
-		/*
-		 * if there already were other objects we would
-		 * need to add a ,
-		 */
-		if (data_len)
-			to_write += 1;
-
-		if (to_write > remaining) {
-			char *__new_progress_objects = 
-				(char*)realloc(pv->update->progress_objects,
-						(2 * pv->update->progress_size));
-			if (!__new_progress_objects)
-				can_write = false;
-			else {
-				pv->update->progress_size *= 2;
-				pv->update->progress_objects = __new_progress_objects;
-			}
-		}
-		if (can_write) {
-			if (data_len) {
-				strcat(pv->update->progress_objects, ",");
-				data_len += 1;
-			}
-			sprintf(pv->update->progress_objects + data_len,"%s",
-					this_obj_json);
-		} else {
-			pv_log(ERROR, "Failed to allocate space for progress data");
-		}
-		pv_log(DEBUG, "progress_objects is %s", 
-				pv->update->progress_objects);
-	}
+	ret = 1;
+	pthread_mutex_lock(&download_lock);
+	pv_objects_catalog_add(obj->id);
+	if (pv->update)
+		trail_download_object_finished(pv->update, &object_update);
+	pthread_mutex_unlock(&download_lock);
+	goto out;
+
+interrupted:
+	// keep what we got so the next retry can continue from there
+	if (resumable && !progress_update.hash_error)
+		trail_download_state_save(&progress_update);
+	else
+		remove(mmc_tmp_obj_path);
 out:
 	if (fd)
 		close(fd);
@@ -1620,14 +3181,22 @@ static int trail_link_objects(struct pantavisor *pv)
 		free(tmp);
 	        ext = strrchr(obj->relpath, '.');
 		if (ext && (strcmp(ext, ".bind") == 0)) {
-			int s_fd, d_fd;
+			int s_fd, d_fd, ret = 0;
 			s_fd = open(obj->objpath, O_RDONLY);
-			d_fd = open(obj->relpath, O_CREAT | O_WRONLY | O_SYNC, 0644);
+			d_fd = open(obj->relpath, O_CREAT | O_WRONLY, 0644);
 			if ((s_fd >= 0) &&
 				(d_fd >= 0)) {
 				pv_log(INFO, "copying bind volume '%s' from '%s'", obj->relpath, obj->objpath);
-				pv_fops_copy_and_close(s_fd, d_fd);
+				ret = pv_fops_copy(s_fd, d_fd);
+				if (ret < 0)
+					pv_log(ERROR, "unable to copy bind volume %s, errno=%d", obj->relpath, errno);
 			}
+			if (s_fd >= 0)
+				close(s_fd);
+			if (d_fd >= 0)
+				close(d_fd);
+			if (ret < 0)
+				return -1;
 			continue;
 		}
 		if (link(obj->objpath, obj->relpath) < 0) {
@@ -1636,7 +3205,7 @@ static int trail_link_objects(struct pantavisor *pv)
 				return -1;
 			}
 		} else {
-			syncdir(obj->objpath);
+			pv_objects_catalog_link(obj->id);
 			pv_log(DEBUG, "linked %s to %s", obj->relpath, obj->objpath);
 		}
 	}
@@ -1666,25 +3235,189 @@ static int trail_check_update_size(struct pantavisor *pv)
 	return 0;
 }
 
+/*
+ * Allocates the tmp file of every object that is going to be downloaded to
+ * storage, so we find out now if something else took the space and the
+ * objects get contiguous blocks
+ */
+static int trail_download_reserve_objects(struct pantavisor *pv)
+{
+	int fd, ret = 0;
+	char path[PATH_MAX], msg[128];
+	struct stat st;
+	struct pv_object *o = NULL;
+
+	if (!trail_download_can_reserve())
+		return 0;
+
+	pv_objects_iter_begin(pv->update->pending, o) {
+		if ((o->size <= 0) || obj_is_kernel_pvk(pv, o) ||
+			!stat(o->objpath, &st))
+			continue;
+
+		if (pv_objects_mkdir(o->id))
+			continue;
+
+		sprintf(path, MMC_TMP_OBJ_FMT, o->objpath);
+		fd = open(path, O_CREAT | O_RDWR, 0644);
+		if (fd < 0)
+			continue;
+
+		ret = trail_download_object_reserve(fd, o);
+		close(fd);
+		if (ret) {
+			pv_log(ERROR, "cannot reserve %"PRIu64" B for %s: %s",
+				(uint64_t) o->size, o->name, strerror(errno));
+			snprintf(msg, sizeof(msg), "Cannot reserve %"PRIu64" B for %s",
+				(uint64_t) o->size, o->name);
+			break;
+		}
+	}
+	pv_objects_iter_end;
+
+	if (!ret)
+		return 0;
+
+	// give back what we took, except downloads that can be resumed
+	pv_objects_iter_begin(pv->update->pending, o) {
+		char state_path[PATH_MAX];
+
+		sprintf(path, MMC_TMP_OBJ_FMT, o->objpath);
+		snprintf(state_path, sizeof(state_path), MMC_TMP_STATE_FMT, path);
+		if (stat(state_path, &st))
+			remove(path);
+	}
+	pv_objects_iter_end;
+
+	pv_update_set_status_msg(pv, UPDATE_NO_DOWNLOAD, msg);
+
+	return -1;
+}
+
+struct download_pool {
+	struct pantavisor *pv;
+	const char **crtfiles;
+	struct dl_list *head;
+	struct dl_list *next;
+	bool failed;
+};
+
+static struct pv_object* trail_download_pool_get(struct download_pool *pool)
+{
+	struct pv_object *o = NULL;
+
+	pthread_mutex_lock(&download_lock);
+	if (!pool->failed && (pool->next != pool->head)) {
+		o = dl_list_entry(pool->next, struct pv_object, list);
+		pool->next = pool->next->next;
+	}
+	pthread_mutex_unlock(&download_lock);
+
+	return o;
+}
+
+static void* trail_download_pool_worker(void *data)
+{
+	struct download_pool *pool = (struct download_pool*) data;
+	struct pantavisor *pv = pool->pv;
+	struct pv_object *o;
+	int i, downloaded;
+
+	while ((o = trail_download_pool_get(pool))) {
+		downloaded = 0;
+		for (i = 0; !downloaded && (i < DOWNLOAD_OBJECT_RETRIES); i++) {
+			if (i)
+				pv_log(INFO, "retrying download of '%s' (%d/%d)",
+					o->name, i, DOWNLOAD_OBJECT_RETRIES - 1);
+			downloaded = trail_download_object(pv, o, pool->crtfiles);
+		}
+
+		pthread_mutex_lock(&download_lock);
+		if (!downloaded) {
+			pool->failed = true;
+		} else {
+			pv->update->total_update->current_time = time(NULL);
+			pv_update_set_status(pv, UPDATE_DOWNLOAD_PROGRESS);
+		}
+		pthread_mutex_unlock(&download_lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Downloads the pending objects with up to updater.download.workers
+ * transfers at a time. The calling thread is one of the workers
+ */
+static int trail_download_objects_pool(struct pantavisor *pv, const char **crtfiles)
+{
+	int i, n, workers;
+	pthread_t threads[DOWNLOAD_WORKERS_MAX];
+	struct download_pool pool = {
+		.pv = pv,
+		.crtfiles = crtfiles,
+		.head = &pv->update->pending->objects,
+		.next = pv->update->pending->objects.next,
+		.failed = false,
+	};
+
+	workers = pv_config_get_updater_download_workers();
+	if (workers < 1)
+		workers = 1;
+	else if (workers > DOWNLOAD_WORKERS_MAX)
+		workers = DOWNLOAD_WORKERS_MAX;
+
+	for (n = 0; n < workers - 1; n++) {
+		if (pthread_create(&threads[n], NULL, trail_download_pool_worker, &pool)) {
+			pv_log(WARN, "could not create download worker: %s", strerror(errno));
+			break;
+		}
+	}
+
+	pv_log(DEBUG, "downloading objects with %d workers", n + 1);
+	trail_download_pool_worker(&pool);
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+
+	return pool.failed ? -1 : 0;
+}
+
 static int trail_download_objects(struct pantavisor *pv)
 {
 	struct pv_object *k_new, *k_old;
 	struct pv_update *u = pv->update;
 	struct pv_object *o = NULL;
-	const char **crtfiles = pv_ph_get_certs(pv);
+	const char **crtfiles;
+	int ret;
 
-	pv_objects_iter_begin(u->pending, o) {
-		if (!trail_download_get_meta(pv, o)) {
-			pv_update_set_status(pv, UPDATE_RETRY_DOWNLOAD);
-			return -1;
-		}
+	if (trail_download_resolve_objects(pv)) {
+		pv_update_set_status(pv, UPDATE_RETRY_DOWNLOAD);
+		return -1;
 	}
-	pv_objects_iter_end;
 
 	// check size and collect garbage if needed
 	if (trail_check_update_size(pv))
 		return -1;
 
+	if (trail_download_reserve_objects(pv))
+		return -1;
+
+	// config can change between updates
+	if (ratelimit_set(&download_ratelimit, pv_config_get_updater_download_ratelimit(),
+		pv_config_get_updater_download_ratelimit_window()))
+		pv_log(WARN, "bad download rate limit window '%s', limiting all day",
+			pv_config_get_updater_download_ratelimit_window());
+
+	// objects from the running revision are the most likely to share chunks
+	// with the new ones. This only takes time the first time it is done
+	if (pv_config_get_storage_chunks()) {
+		pv_objects_iter_begin(pv->state, o) {
+			pv_chunks_index_object(o->id);
+		}
+		pv_objects_iter_end;
+	}
+
 	if (pv->state->bsp.img.std.kernel) {
 		k_new = pv_objects_get_by_name(u->pending,
 				u->pending->bsp.img.std.kernel);
@@ -1697,6 +3430,9 @@ static int trail_download_objects(struct pantavisor *pv)
 				pv->state->bsp.img.ut.fit);
 	}
 
+	pv_mirrors_load(pv_config_get_updater_mirrors());
+	progress_reporter_start(pv);
+
 	if (u->total_update) {
 		u->total_update->object_name = "total";
 		u->total_update->object_id = "none";
@@ -1706,15 +3442,22 @@ static int trail_download_objects(struct pantavisor *pv)
 		u->total_update->current_time = time(NULL);
 		pv_update_set_status(pv, UPDATE_DOWNLOAD_PROGRESS);
 	}
-	pv_objects_iter_begin(u->pending, o) {
-		if (!trail_download_object(pv, o, crtfiles)) {
-			pv_update_set_status(pv, UPDATE_RETRY_DOWNLOAD);
-			return -1;
-		}
+	crtfiles = pv_ph_get_certs(pv);
+	ret = trail_download_objects_pool(pv, crtfiles);
+	pv_ph_put_certs(crtfiles);
+	// indexes are read once per update, objects may be gone until the next one
+	pv_chunks_drop_refs();
+
+	if (ret) {
+		progress_reporter_stop();
+		trail_download_set_throughput(0);
+		pv_update_set_status(pv, UPDATE_RETRY_DOWNLOAD);
+		return -1;
 	}
-	u->total_update->current_time = time(NULL);
-	pv_update_set_status(pv, UPDATE_DOWNLOAD_PROGRESS);
-	pv_objects_iter_end;
+
+	progress_reporter_stop();
+	trail_download_set_throughput(0);
+
 	return 0;
 }
 
@@ -1797,6 +3540,7 @@ out:
 int pv_update_install(struct pantavisor *pv)
 {
 	int ret = -1, fd;
+	ssize_t len;
 	struct pv_state *pending = pv->update->pending;
 	char path[PATH_MAX];
 	char path_new[PATH_MAX];
@@ -1819,24 +3563,46 @@ int pv_update_install(struct pantavisor *pv)
 		goto out;
 	}
 
-	// install state.json for new rev
+	if (!pv_storage_meta_expand_jsons(pv, pending)) {
+		pv_log(ERROR, "unable to install platform and pantavisor jsons");
+		ret = -1;
+		goto out;
+	}
+
+	// stage state.json for new rev
 	sprintf(path_new, "%s/trails/%s/.pvr/json.new", pv_config_get_storage_mntpoint(), pending->rev);
 	sprintf(path, "%s/trails/%s/.pvr/json", pv_config_get_storage_mntpoint(), pending->rev);
-	fd = open(path_new, O_CREAT | O_WRONLY | O_SYNC | O_TRUNC, 0644);
+	fd = open(path_new, O_CREAT | O_WRONLY | O_TRUNC, 0644);
 	if (fd < 0) {
 		pv_log(ERROR, "unable to write state.json file for update: %s", strerror(errno));
 		ret = -1;
 		goto out;
 	}
-	pv_fops_write_nointr(fd, pending->json, strlen(pending->json));
+	len = strlen(pending->json);
+	if (pv_fops_write_nointr(fd, pending->json, len) != len) {
+		pv_log(ERROR, "unable to write state.json file for update: %s", strerror(errno));
+		close(fd);
+		ret = -1;
+		goto out;
+	}
 	close(fd);
-	rename(path_new, path);
 
-	if (!pv_storage_meta_expand_jsons(pv, pending)) {
-		pv_log(ERROR, "unable to install platform and pantavisor jsons");
+	/*
+	 * Nothing above was synced. One barrier for the whole storage makes
+	 * the staged links and files durable, then the rename of state.json
+	 * marks the revision as complete
+	 */
+	if (syncfs_path(pv_config_get_storage_mntpoint())) {
+		pv_log(ERROR, "unable to sync staged revision: %s", strerror(errno));
+		ret = -1;
+		goto out;
+	}
+	if (rename(path_new, path)) {
+		pv_log(ERROR, "unable to install state.json file for update: %s", strerror(errno));
 		ret = -1;
 		goto out;
 	}
+	syncdir(path);
 
 	pv_log(DEBUG, "update successfully installed");
 	if (pv_bootloader_set_installed(pending->rev)) {
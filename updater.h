@@ -45,13 +45,38 @@
 
 
 #define TRAIL_OBJECT_DL_FMT	"/objects/%s"
+#define TRAIL_OBJECT_DELTA_FMT	"/objects/%s/deltas/%s"
+#define TRAIL_OBJECTS_RESOLVE_ENDPOINT	"/objects/resolve"
+#define TRAIL_OBJECTS_RESOLVE_MAX	50
 #define DEVICE_TRAIL_ENDPOINT_QUEUED "?progress.status=QUEUED"
 #define DEVICE_TRAIL_ENDPOINT_NEW "?progress.status=NEW"
 #define DEVICE_TRAIL_ENDPOINT_DOWNLOADING "?progress.status=DOWNLOADING"
 #define DEVICE_TRAIL_ENDPOINT_INPROGRESS "?progress.status=INPROGRESS"
+// progress.status={"$in":["INPROGRESS","DOWNLOADING","QUEUED","NEW"]}
+#define DEVICE_TRAIL_ENDPOINT_PENDING "?progress.status=%7B%22%24in%22%3A%5B%22INPROGRESS%22%2C%22DOWNLOADING%22%2C%22QUEUED%22%2C%22NEW%22%5D%7D"
+// empty combined query results are confirmed with the full sequence every N checks
+#define DEVICE_TRAIL_PENDING_CONFIRM 10
+
+// signed urls are reused until SIGNED_URL_MARGIN secs before they expire
+#define SIGNED_URL_MARGIN	60
+#define SIGNED_URL_DEFAULT_TTL	(5 * 60)
 
 #define VOLATILE_TMP_OBJ_PATH "/tmp/object-XXXXXX"
 #define MMC_TMP_OBJ_FMT "%s.tmp"
+#define MMC_TMP_DELTA_FMT "%s.delta"
+#define MMC_TMP_STATE_FMT "%s.state"
+
+#define DOWNLOAD_WORKERS_MAX	8
+#define DOWNLOAD_OBJECT_RETRIES	3
+
+// bytes downloaded between two saves of the download state
+#define DOWNLOAD_STATE_INTERVAL	(4 * 1024 * 1024)
+
+// source object and VCDIFF delta, new object is written to stdout
+#define TRAIL_DELTA_CMD_FMT "xdelta3 -d -c -s %s %s"
+
+// gzip from stdin to stdout
+#define TRAIL_DECOMPRESS_CMD "gzip -d -c"
 
 #define UPDATE_PROGRESS_FREQ 	(3) /*3 seconds for update*/
 
@@ -72,7 +97,8 @@ enum update_state {
 	UPDATE_RETRY_DOWNLOAD,
 	UPDATE_TESTING_REBOOT,
 	UPDATE_TESTING_NONREBOOT,
-	UPDATE_DOWNLOAD_PROGRESS
+	UPDATE_DOWNLOAD_PROGRESS,
+	UPDATE_SKIPPED
 };
 
 struct object_update {
@@ -88,21 +114,24 @@ struct pv_update {
 	enum update_state status;
 	char *endpoint;
 	int runlevel;
-	int progress_size;
 	struct timer retry_timer;
 	struct pv_state *pending;
-	char *progress_objects;
+	// objects downloaded so far, serialized in each progress report
+	struct object_update *progress_objects;
+	int progress_len;
+	int progress_size;
 	int retries;
 	struct object_update *total_update;
 	bool local;
 };
 
 struct trail_remote {
-	trest_ptr client;
 	char *endpoint_trail_queued;
 	char *endpoint_trail_new;
 	char *endpoint_trail_downloading;
 	char *endpoint_trail_inprogress;
+	char *endpoint_trail_pending;
+	int pending_idle;
 	struct pv_state *pending;
 };
 
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2021 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "dlstate.h"
+#include "fops.h"
+
+int dlstate_save(const char *path, const char *id, uint64_t offset)
+{
+	int fd;
+	char path_tmp[PATH_MAX];
+	struct dlstate state;
+
+	memset(&state, 0, sizeof(state));
+	state.magic = DLSTATE_MAGIC;
+	state.version = DLSTATE_VERSION;
+	state.size = sizeof(state);
+	strncpy(state.id, id, sizeof(state.id) - 1);
+	state.offset = offset;
+
+	snprintf(path_tmp, sizeof(path_tmp), "%s.new", path);
+	fd = open(path_tmp, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+
+	if ((pv_fops_write_nointr(fd, (char*) &state, sizeof(state)) != sizeof(state)) ||
+		fsync(fd)) {
+		close(fd);
+		remove(path_tmp);
+		return -1;
+	}
+	close(fd);
+
+	return rename(path_tmp, path);
+}
+
+int dlstate_load(const char *path, const char *id, uint64_t *offset)
+{
+	int fd;
+	char c;
+	ssize_t len;
+	struct dlstate state;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	len = pv_fops_read_nointr(fd, (char*) &state, sizeof(state));
+	// files longer than a state are not a state either
+	if ((len == sizeof(state)) && (read(fd, &c, 1) > 0))
+		len = -1;
+	close(fd);
+
+	if ((len != sizeof(state)) ||
+		(state.magic != DLSTATE_MAGIC) ||
+		(state.version != DLSTATE_VERSION) ||
+		(state.size != sizeof(state)) ||
+		strncmp(state.id, id, sizeof(state.id)))
+		return -1;
+
+	*offset = state.offset;
+
+	return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2021 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef DLSTATE_H
+#define DLSTATE_H
+
+#include <stdint.h>
+
+/*
+ * State of an interrupted download, saved next to its tmp file: what object
+ * it is and up to where the file was synced. Files written by another
+ * version or of another size are not loaded
+ */
+#define DLSTATE_MAGIC	0x53445650 // "PVDS"
+#define DLSTATE_VERSION	1
+
+struct dlstate {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	char id[65];
+	uint64_t offset;
+};
+
+// writes the state to path atomically. Returns 0 on success
+int dlstate_save(const char *path, const char *id, uint64_t offset);
+
+// reads offset from the state in path if it belongs to id. Returns 0 on success
+int dlstate_load(const char *path, const char *id, uint64_t *offset);
+
+#endif // DLSTATE_H
@@ -20,6 +20,11 @@
  * SOFTWARE.
  */
 
+// sync_file_range
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,6 +35,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/xattr.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+
 #include <signal.h>
 #include "fops.h"
 #include "tsh.h"
@@ -178,18 +188,147 @@ out:
 	return fd;
 }
 
-int pv_fops_copy_and_close(int s_fd, int d_fd)
+void pv_fops_writeback_window(int fd, off_t offset, off_t len)
+{
+	sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WRITE);
+
+	if (offset < len)
+		return;
+
+	sync_file_range(fd, offset - len, len,
+		SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+		SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(fd, offset - len, len, POSIX_FADV_DONTNEED);
+}
+
+#define FOPS_COPY_BUF_SIZE (128 * 1024)
+
+/*
+ * The in kernel copies return the copied size or -errno, so the caller can
+ * fall back when the call is not supported. The fallbacks copy from offset 0
+ * again, overwriting whatever a failed attempt left behind.
+ */
+static ssize_t pv_fops_copy_range(int s_fd, int d_fd, off_t size)
+{
+#ifdef SYS_copy_file_range
+	loff_t off_in = 0, off_out = 0;
+	ssize_t ret;
+
+	while (off_in < size) {
+		ret = syscall(SYS_copy_file_range, s_fd, &off_in, d_fd, &off_out,
+				size - off_in, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		if (!ret)
+			break;
+	}
+	return off_in;
+#else
+	return -ENOSYS;
+#endif
+}
+
+static ssize_t pv_fops_copy_sendfile(int s_fd, int d_fd, off_t size)
+{
+	off_t off = 0;
+	ssize_t ret;
+
+	if (lseek(d_fd, 0, SEEK_SET) < 0)
+		return -errno;
+
+	while (off < size) {
+		ret = sendfile(d_fd, s_fd, &off, size - off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		if (!ret)
+			break;
+	}
+	return off;
+}
+
+static ssize_t pv_fops_copy_buf(int s_fd, int d_fd)
 {
-	int bytes_r = 0, bytes_w = 0;
-	char buf[4096];
+	ssize_t bytes_r, bytes_w, total = 0;
+	char *buf;
 
-	lseek(s_fd, 0, SEEK_SET);
-	lseek(d_fd, 0, SEEK_SET);
+	buf = malloc(FOPS_COPY_BUF_SIZE);
+	if (!buf)
+		return -1;
 
-	while (bytes_r = read(s_fd, buf, sizeof(buf)), bytes_r > 0)
-		bytes_w += write(d_fd, buf, bytes_r);
+	if (lseek(s_fd, 0, SEEK_SET) < 0 || lseek(d_fd, 0, SEEK_SET) < 0) {
+		total = -1;
+		goto out;
+	}
+
+	while (1) {
+		bytes_r = pv_fops_read_nointr(s_fd, buf, FOPS_COPY_BUF_SIZE);
+		if (bytes_r < 0) {
+			total = -1;
+			goto out;
+		}
+		if (!bytes_r)
+			break;
+		bytes_w = pv_fops_write_nointr(d_fd, buf, bytes_r);
+		if (bytes_w != bytes_r) {
+			total = -1;
+			goto out;
+		}
+		total += bytes_w;
+	}
+
+out:
+	free(buf);
+	return total;
+}
+
+/*
+ * Tries to share the source extents (reflink) first, then falls back to
+ * in kernel copies and finally to a plain read/write loop, so we only pay
+ * for a userspace copy on filesystems that support nothing better.
+ */
+ssize_t pv_fops_copy(int s_fd, int d_fd)
+{
+	struct stat st;
+	ssize_t ret;
+
+	if (fstat(s_fd, &st))
+		return -1;
+
+	// a clone keeps the destination bytes past the end of the source
+	if (ftruncate(d_fd, 0))
+		return -1;
+
+#ifdef FICLONE
+	if (!ioctl(d_fd, FICLONE, s_fd))
+		return st.st_size;
+#endif
+
+	ret = pv_fops_copy_range(s_fd, d_fd, st.st_size);
+	if (ret == -ENOSYS || ret == -EXDEV || ret == -EINVAL ||
+	    ret == -EOPNOTSUPP || ret == -EBADF)
+		ret = pv_fops_copy_sendfile(s_fd, d_fd, st.st_size);
+	if (ret == -ENOSYS || ret == -EINVAL)
+		ret = pv_fops_copy_buf(s_fd, d_fd);
+	if (ret < 0)
+		return -1;
+
+	// source grew or shrank while we were copying
+	if (ret != st.st_size)
+		return -1;
+
+	return ret;
+}
+
+int pv_fops_copy_and_close(int s_fd, int d_fd)
+{
+	ssize_t ret;
 
+	ret = pv_fops_copy(s_fd, d_fd);
 	close(s_fd);
 
-	return bytes_r;
+	return ret < 0 ? -1 : 0;
 }
@@ -42,6 +42,16 @@ int pv_fops_open_and_lock_file(const char *fname, int flags, mode_t mode);
 int pv_fops_unlock_file(int fd);
 int pv_fops_gzip_file(const char *filename, const char *target_name);
 int pv_fops_check_and_open_file(const char *fname, int flags, mode_t mode);
+/*
+ * Copies the whole content of s_fd into d_fd, returns the number of bytes
+ * copied or -1 on error.
+ */
+ssize_t pv_fops_copy(int s_fd, int d_fd);
 int pv_fops_copy_and_close(int s_fd, int d_fd);
+/*
+ * Starts writeback of [offset, offset + len) and waits for the window just
+ * before it, which is then dropped from the page cache.
+ */
+void pv_fops_writeback_window(int fd, off_t offset, off_t len);
 
 #endif /* UTILS_PV_FOPS_H_ */
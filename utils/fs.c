@@ -30,6 +30,7 @@
 #include <libgen.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
 #include <linux/limits.h>
 
 #include "fs.h"
@@ -90,6 +91,31 @@ void syncdir(char *file)
 		free(dir);
 }
 
+int syncfs_path(char *path)
+{
+	int fd, ret = -1;
+
+	if (!path)
+		return -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+#ifdef SYS_syncfs
+	ret = syscall(SYS_syncfs, fd);
+#endif
+	// no per filesystem sync available, flush everything
+	if (ret < 0) {
+		sync();
+		ret = 0;
+	}
+
+	close(fd);
+
+	return ret;
+}
+
 int remove_at(char *path, char *filename)
 {
 	char full_path[PATH_MAX];
@@ -28,6 +28,7 @@
 bool dir_exist(const char *dir);
 int mkdir_p(char *dir, mode_t mode);
 void syncdir(char *dir);
+int syncfs_path(char *path);
 int remove_in(char *path, char *dirname);
 int remove_at(char *path, char *filename);
 
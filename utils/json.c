@@ -21,6 +21,8 @@
  */
 
 #include <stdbool.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include "json.h"
@@ -215,3 +217,53 @@ out:
 	}
 	return json_string;
 }
+
+int pv_json_buf_init(struct pv_json_buf *js, int size)
+{
+	js->len = 0;
+	js->size = size > 0 ? size : 256;
+	js->buf = calloc(1, js->size);
+
+	return js->buf ? 0 : -1;
+}
+
+int pv_json_buf_printf(struct pv_json_buf *js, const char *fmt, ...)
+{
+	va_list args;
+	int n, size;
+	char *buf;
+
+	if (!js->buf)
+		return -1;
+
+	while (1) {
+		va_start(args, fmt);
+		n = vsnprintf(js->buf + js->len, js->size - js->len, fmt, args);
+		va_end(args);
+		if (n < 0)
+			return -1;
+		if (js->len + n < js->size)
+			break;
+
+		size = js->size * 2;
+		while (js->len + n >= size)
+			size *= 2;
+		buf = realloc(js->buf, size);
+		if (!buf)
+			return -1;
+		js->buf = buf;
+		js->size = size;
+	}
+	js->len += n;
+
+	return n;
+}
+
+void pv_json_buf_free(struct pv_json_buf *js)
+{
+	if (js->buf)
+		free(js->buf);
+	js->buf = NULL;
+	js->len = 0;
+	js->size = 0;
+}
@@ -25,6 +25,18 @@
 
 #include <jsmn/jsmnutil.h>
 
+/*
+ * growable buffer to serialize json. buf is always null terminated
+ */
+struct pv_json_buf {
+	char *buf;
+	int len;
+	int size;
+};
+
+int pv_json_buf_init(struct pv_json_buf *js, int size);
+int pv_json_buf_printf(struct pv_json_buf *js, const char *fmt, ...);
+void pv_json_buf_free(struct pv_json_buf *js);
 
 int pv_json_get_key_count(const char *buf, const char *key, jsmntok_t *tok, int tokc);
 char* pv_json_get_one_str(const char *buf, jsmntok_t **tok);
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2021 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "ratelimit.h"
+
+// transfers idle for this long have no throughput
+#define RATELIMIT_IDLE_MS 2000
+
+static uint64_t ratelimit_elapsed_ms(struct timespec *from, struct timespec *to)
+{
+	int64_t ms = (to->tv_sec - from->tv_sec) * 1000 +
+		(to->tv_nsec - from->tv_nsec) / 1000000;
+
+	return ms > 0 ? ms : 0;
+}
+
+static bool ratelimit_in_window(struct ratelimit *rl)
+{
+	struct tm tm;
+	time_t now;
+	int min;
+
+	if (rl->window_start < 0)
+		return true;
+
+	now = time(NULL);
+	if (!localtime_r(&now, &tm))
+		return true;
+
+	min = tm.tm_hour * 60 + tm.tm_min;
+	if (rl->window_start <= rl->window_end)
+		return (min >= rl->window_start) && (min < rl->window_end);
+
+	// window goes through midnight
+	return (min >= rl->window_start) || (min < rl->window_end);
+}
+
+int ratelimit_set(struct ratelimit *rl, int kibps, const char *window)
+{
+	int ret = 0;
+	unsigned int h1, m1, h2, m2;
+
+	pthread_mutex_lock(&rl->lock);
+
+	rl->rate = kibps > 0 ? (uint64_t) kibps * 1024 : 0;
+	rl->tokens = rl->rate;
+	clock_gettime(CLOCK_MONOTONIC, &rl->last);
+	rl->since = rl->last;
+	rl->bytes = 0;
+	rl->throughput = 0;
+
+	rl->window_start = -1;
+	if (window && window[0]) {
+		if ((sscanf(window, "%u:%u-%u:%u", &h1, &m1, &h2, &m2) == 4) &&
+			(h1 < 24) && (m1 < 60) && (h2 < 24) && (m2 < 60)) {
+			rl->window_start = h1 * 60 + m1;
+			rl->window_end = h2 * 60 + m2;
+		} else {
+			ret = -1;
+		}
+	}
+
+	pthread_mutex_unlock(&rl->lock);
+
+	return ret;
+}
+
+void ratelimit_consume(struct ratelimit *rl, size_t bytes)
+{
+	struct timespec now, wait = { 0, 0 };
+	uint64_t ms;
+
+	pthread_mutex_lock(&rl->lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	rl->bytes += bytes;
+	ms = ratelimit_elapsed_ms(&rl->since, &now);
+	if (ms >= 1000) {
+		rl->throughput = rl->bytes * 1000 / ms;
+		rl->bytes = 0;
+		rl->since = now;
+	}
+
+	if (!rl->rate || !ratelimit_in_window(rl)) {
+		rl->tokens = rl->rate;
+		goto out;
+	}
+
+	// refill up to one second of traffic, so idle time does not become a burst
+	rl->tokens += ratelimit_elapsed_ms(&rl->last, &now) * rl->rate / 1000;
+	if (rl->tokens > (int64_t) rl->rate)
+		rl->tokens = rl->rate;
+
+	// the debt is paid sleeping here, which also holds back the sender
+	rl->tokens -= bytes;
+	if (rl->tokens < 0) {
+		ms = -rl->tokens * 1000 / rl->rate;
+		wait.tv_sec = ms / 1000;
+		wait.tv_nsec = (ms % 1000) * 1000000;
+	}
+
+out:
+	rl->last = now;
+	pthread_mutex_unlock(&rl->lock);
+
+	if (wait.tv_sec || wait.tv_nsec)
+		nanosleep(&wait, NULL);
+}
+
+uint64_t ratelimit_get_throughput(struct ratelimit *rl)
+{
+	struct timespec now;
+	uint64_t throughput;
+
+	pthread_mutex_lock(&rl->lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	throughput = rl->throughput;
+	if (ratelimit_elapsed_ms(&rl->since, &now) >= RATELIMIT_IDLE_MS)
+		throughput = 0;
+
+	pthread_mutex_unlock(&rl->lock);
+
+	return throughput;
+}
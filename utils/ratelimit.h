@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2021 Pantacor Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Token bucket shared by all the transfers of one kind. The limit can be
+ * restricted to a time of day window, in minutes since local midnight
+ */
+struct ratelimit {
+	pthread_mutex_t lock;
+	uint64_t rate; // bytes per second, 0 for no limit
+	int64_t tokens;
+	struct timespec last;
+	int window_start; // -1 for all day
+	int window_end;
+	// measured throughput, with or without limit
+	uint64_t bytes;
+	struct timespec since;
+	uint64_t throughput;
+};
+
+#define RATELIMIT_INIT { .lock = PTHREAD_MUTEX_INITIALIZER, .window_start = -1 }
+
+/*
+ * kibps is the limit in KiB/s. window is "HH:MM-HH:MM" or NULL, and can go
+ * through midnight. Returns -1 if window cannot be parsed, leaving the
+ * limit all day
+ */
+int ratelimit_set(struct ratelimit *rl, int kibps, const char *window);
+
+// accounts bytes and sleeps if they go over the limit
+void ratelimit_consume(struct ratelimit *rl, size_t bytes);
+
+// bytes per second in the last measured second, 0 if idle
+uint64_t ratelimit_get_throughput(struct ratelimit *rl);
+
+#endif // RATELIMIT_H